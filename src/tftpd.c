@@ -10,26 +10,105 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <unistd.h>
 #include <sys/time.h> 
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include <linux/errqueue.h>
+#include <linux/openat2.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include <glib.h>
 
 /////////////
 // Defines //
 /////////////
 #define ERROR(x) ((x) < 0)
-#define INACTIVE_TIMER 5
-#define CLIENT_TIMEOUT 5
-#define MAX_RESENDS 5
+#define CONTAINER_OF(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+#define MAX_CLIENT_TIMEOUT 255  // seconds, of the timeout option
+#define INITIAL_TIMEOUT 1000    // milliseconds, before a client's first round trip
+#define DEFAULT_MIN_TIMEOUT 20  // milliseconds
+#define DEFAULT_MAX_TIMEOUT 5000
+#define DEFAULT_RESENDS 10
+#define MAX_RESENDS 1000
+#define MAX_EVENTS 64
+#define DEFAULT_BATCH_SIZE 32
+#define MAX_BATCH_SIZE 1024
+#define MAX_WORKERS 256
+#define DEFAULT_MAX_TRANSFERS 4096
+#define MAX_TRANSFERS (1 << 24)
+#define DEFAULT_CACHE_SIZE 64   // megabytes
+#define MAX_CACHE_SIZE (1 << 20)
+#define DEFAULT_READERS 2
+#define MAX_READERS 64
+#define READ_AHEAD (1 << 18)    // bytes faulted in ahead of a transfer
+#define RING_ENTRIES 64
+#define ZERO_COPY_MIN (1 << 14) // smaller payloads are cheaper to copy than to pin
+#define ZERO_COPY_MAX (60 << 10) // larger may span more pages than a datagram can hold
+#define GSO_MAX_SEGMENTS 64     // datagrams the kernel splits one send into
+#define GSO_MAX_BYTES 65507     // and their total, the payload of one IPv4 datagram
+#define SEGMENT_CONTROL CMSG_SPACE(sizeof(uint16_t))
+#define LOG_ENTRIES 4096        // records in the log ring, a power of two
+#define LOG_LINE 256            // longest record, longer ones are cut
+#define LOG_BUFFER (1 << 16)    // written out by the log thread at once
+#define LOG_INTERVAL 50         // milliseconds the log thread sleeps when idle
+#define ADDRESS_SIZE 22         // "255.255.255.255:65535"
+#define HISTOGRAM_SUB_BITS 3    // 8 buckets per power of two, within 12.5%
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+#define METRIC_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define MAX_UPLOAD_BLOCK_SIZE 8192 // largest block taken in an upload, bounds the input buffers
+#define INPUT_SIZE (4 + MAX_UPLOAD_BLOCK_SIZE + 1) // a DATA block and a terminating 0
+#define UPLOAD_CHUNK (1 << 18)  // bytes of an upload written at once, at offsets a multiple of it
+#define UPLOAD_MODE 0644        // of uploaded files, less the umask
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_BUFFER (1 << 16)  // inotify events read, and applied under one lock, at once
+#define SINGLE_RECORDS 1024     // single block transfers waiting for ACK 0 per worker, a power of two
+#define SINGLE_OACK_SIZE 96     // longest OACK, with every option
+#define DEFAULT_BLOCK_SIZE 512
+#define SLAB_BUFFER (4 + DEFAULT_BLOCK_SIZE) // buffer of each client in the slab, a default block or the OACK
+#define MIN_BLOCK_SIZE 8
+#define MAX_BLOCK_SIZE 65464
+#define MAX_WINDOW_SIZE 64
+#define MAX_WINDOW_BYTES (1 << 20)
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22   // Linux 5.14
+#endif
 
 //////////////
 // Typedefs //
@@ -47,7 +126,8 @@ typedef enum
     DATA = 3, // data 
     ACK = 4,  // acknowledgement
     ERR = 5,  // error
-    NONE = 6  // none
+    OACK = 6, // option acknowledgement
+    NONE = 7  // none
 } opcode;
 
 typedef enum 
@@ -62,6 +142,30 @@ typedef enum
     NO_USER 
 } error_code;
 
+typedef enum
+{
+    DEBUG_LEVEL = 0,
+    INFO_LEVEL,
+    WARN_LEVEL,
+    ERROR_LEVEL
+} log_level;
+
+typedef enum
+{
+    DONE_RESULT = 0,
+    TIMEOUT_RESULT,
+    ERROR_RESULT,
+    CANCELLED_RESULT
+} transfer_result;
+
+typedef enum
+{
+    READ_IO = 0,        // a range faulted in ahead of a transfer
+    WRITE_IO,           // a chunk of an upload written to its file
+    SYNC_IO,            // a finished upload synced to disk
+    CONVERT_IO          // a cached file converted to netascii, by a reader thread only
+} io_kind;
+
 typedef enum
 {
     netascii = 1,
@@ -80,28 +184,430 @@ typedef struct
 
 typedef struct
 {
-    FILE* file_fd;
-    char buffer[516];
-    size_t buffer_size;
-    uint16_t block_number;
+    uint16_t block_size;
+    uint16_t window_size;
+    uint8_t timeout;
+    uint64_t transfer_size;
+    bool has_block_size;
+    bool has_window_size;
+    bool has_timeout;
+    bool has_transfer_size;
+} transfer_options;
+
+typedef struct timer_entry
+{
+    struct timer_entry* next;   // NULL when not scheduled
+    struct timer_entry* prev;
+    uint64_t expires;           // milliseconds on the monotonic clock
+} timer_entry;
+
+typedef struct
+{
+    char* data;             // opcode, block number and payload, or one of data_headers
+    size_t size;
+    const char* payload;    // payload sent from the mapped file, after data
+    size_t payload_size;
+    uint64_t queued_at;     // flush count when the block was last queued
+} block_slot;
+
+typedef struct cached_file
+{
+    struct file_cache* cache;
+    char* path;                 // key in the cache, the name relative to the root
+    dev_t device;               // device, inode, time and size tell if the file changed
+    ino_t inode;
+    struct timespec modified;
+    uint64_t size;
+    char* data;                 // the file mapped read only, NULL if empty
+    char* netascii;             // the file converted to netascii, NULL until a client wants it
+    uint64_t netascii_size;
+    uint32_t users;             // transfers reading from it
+    bool converting;            // a reader thread is converting it, see queue_conversion
+    bool cached;                // false once replaced or evicted, freed with its last user
+                                // or mapped for a single transfer, cache is then NULL
+    struct cached_file* next;   // LRU list, most recently used first
+    struct cached_file* prev;
+} cached_file;
+
+typedef struct
+{
+    dev_t device;               // as fstatat saw it, without following a symbolic link
+    ino_t inode;
+    struct timespec modified;
+    uint64_t size;
+    mode_t type;                // S_IFREG, S_IFDIR, S_IFLNK...
+    bool unread;                // a directory added whose entries are not indexed yet, see index_added
+    char name[];                // key in the index, relative to the root
+} index_entry;
+
+typedef struct
+{
+    GHashTable* entries;        // name to index_entry, everything beneath the root
+    GHashTable* dirs;           // inotify watch to the name of its directory, "" for the root
+    int32_t watch_fd;           // inotify, -1 if there is no index
+    int32_t wake;               // eventfd, written to stop the index thread
+    pthread_t thread;
+    bool ready;                 // every directory is watched, so a name not in it does not exist
+    uint64_t missing;           // requests for names not in it, answered without a syscall
+} file_index;
+
+typedef struct file_cache
+{
+    pthread_mutex_t lock;
+    GHashTable* files;          // path to cached_file
+    cached_file lru;            // list head
+    uint64_t budget;            // bytes, 0 disables the cache
+    uint64_t used;              // this and the counters below change under lock, see METRIC_ADD
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t conversions;       // netascii forms built
+    uint64_t unopened;          // hits the file index vouched for, which were not opened
+    const char* root;           // directory files are served from
+    int32_t root_fd;            // opened once, names are resolved beneath it
+    file_index index;           // guarded by lock as well
+} file_cache;
+
+typedef enum
+{
+    LISTENER_EVENT = 1, // main listening socket
+    TRANSFER_EVENT,     // socket of a single transfer
+    TIMER_EVENT,        // inactivity timer
+    READ_EVENT,         // reads ahead are done
+    SHUTDOWN_EVENT      // server is shutting down
+} event_type;
+
+typedef struct
+{
+    event_type type;
+    int32_t fd;
+} event_source;
+
+typedef struct upload_state
+{
+    int32_t fd;                 // the temporary file, -1 once closed
+    int32_t dir_fd;             // directory the file goes in
+    char* path;                 // the file asked for, relative to the root
+    char* name;                 // its name in the directory, the temporary one is renamed to it
+    char* temp_name;            // ".<name>.<pid>.<count>" next to it
+    char* chunks[2];            // UPLOAD_CHUNK each, one is filled while the other is written
+    size_t sizes[2];            // bytes in each
+    uint64_t offsets[2];        // where in the file each goes
+    uint64_t submitted[2];      // microseconds, when its write started
+    bool writing[2];
+    uint32_t filling;           // chunk blocks go into
+    uint64_t end;               // file offset after the last chunk written
+    uint32_t in_flight;         // writes and syncs not done yet
+    int32_t error;              // errno of a failed write or sync, 0 if none
+    uint64_t bytes;             // payload taken, as received
+    uint64_t finished;          // microseconds, when the file was renamed, 0 before
+    uint16_t last_number;       // block number of the last block taken, as sent
+    uint16_t in_window;         // blocks taken since the last ACK
+    bool ack_held;              // ACK of a full window waits for a chunk to be written
+    bool synced;
+    bool carry;                 // netascii '\r' at the end of the last block
+} upload_state;
+
+typedef struct client_value
+{
+    timer_entry timer;          // resend deadline in the worker's timer wheel
+    event_source event;         // the transfer's own socket, fd is -1 if it uses the server's
+    sockaddr_in address;        // the client's key in the pool
+    struct client_value* link;  // in the worker's list of removed clients or the slab's free list
+    cached_file* file;          // the mapped file, shared if it is in the cache
+    const char* source;         // what is sent, the file or its netascii form
+    uint64_t source_size;
+    uint64_t offset;            // next byte to read from source
+    char* buffer;               // memory for all slots in the window
+    block_slot* window;         // ring of blocks, block b is in slot b % window_size
+    uint16_t block_size;
+    uint16_t window_size;
+    uint64_t base;              // first block not acknowledged, 0 is the OACK
+    uint64_t next;              // next block to send
+    uint64_t read;              // last block read from file into the window
+    uint64_t last_block;        // final (short) block, 0 until it has been read
+    uint64_t rewound_base;      // base when we last went back to resend the window
+    uint64_t timeout;           // milliseconds before we resend the window, see estimate_timeout
     uint16_t resends;
+    bool fixed_timeout;         // the client asked for its timeout, it is neither estimated nor backed off
     mode md;
+    bool zero_copy;             // blocks point into source instead of being copied to buffer
+    int32_t fd;                 // the file, blocks are read from it with pread unless zero_copy, else -1
     char temp_char;
-    time_t last_action;
+    uint64_t resident;          // source up to here is in memory, see read_ahead
+    uint64_t reading;           // end of the range being read ahead, 0 if none
+    bool stalled;               // waiting for a read ahead before sending more
+    uint64_t started;           // microseconds, when its request was received
+    bool replied;               // its first OACK or DATA block was queued, see first_reply
+    uint64_t timed_block;       // block whose ACK is timed, 0 if none, see time_ack
+    uint64_t timed_at;          // microseconds, when it was sent
+    uint64_t srtt;              // microseconds, smoothed round trip, 0 until the first one
+    uint64_t rttvar;            // and its variation
+    upload_state* upload;       // NULL unless the client is writing to us
 } client_value;
 
 typedef struct
 {
+    timer_entry slots[WHEEL_LEVELS][WHEEL_SLOTS];   // list heads
+    uint64_t occupied[WHEEL_LEVELS];                // bit per slot that may hold timers
+    uint64_t current;                               // last millisecond processed
+    uint64_t armed;                                 // when the timer fd fires, UINT64_MAX if never
+    int32_t fd;
+} timer_wheel;
+
+typedef struct
+{
+    uint32_t address;           // client's address and port as in sockaddr_in
+    uint16_t port;
+    client_value* client;       // NULL if the slot is empty
+} table_slot;
+
+typedef struct
+{
+    table_slot* slots;          // open addressing with linear probing
+    uint32_t mask;              // number of slots - 1, a power of two
+    uint32_t count;
+} client_table;
+
+typedef struct
+{
+    client_value* clients;      // all of the worker's transfers, allocated at startup
+    char* buffers;              // SLAB_BUFFER bytes per client, its buffer unless that is larger
+    block_slot* slots;          // one per client, its window unless that is larger
+    client_value* free;         // free list
+    uint32_t capacity;
+    uint32_t used;              // written by the worker only, see METRIC_ADD
+} client_slab;
+
+typedef enum
+{
+    SINGLE_OFF = 0,     // every file is sent by a transfer
+    SINGLE_RECORD,      // a record is kept while an OACK waits for ACK 0
+    SINGLE_STATELESS    // options are ignored and only where blocks went is kept
+} single_mode;
+
+typedef struct
+{
+    sockaddr_in address;        // the client, port 0 if the record is free
+    cached_file* file;          // a user of it is held while the record is
+    const char* payload;        // all of the file, or its netascii form
+    uint16_t payload_size;      // under one block
+    uint16_t oack_size;
+    uint64_t expires;           // milliseconds, the record is free after
+    uint64_t queued_at;         // flush count when the OACK was last queued
+    char oack[SINGLE_OACK_SIZE];
+} single_record;
+
+typedef struct
+{
+    sockaddr_in address;        // the client, port 0 if the slot is free
+    uint64_t expires;           // milliseconds, its ACK 1 is stray after
+} single_sent;
+
+typedef struct
+{
+    const char* port;
+    const char* root;
+    uint32_t batch_size;
+    uint32_t workers;
+    bool transfer_sockets;
+    uint64_t cache_size;
+    uint32_t max_transfers;
+    uint32_t readers;           // 0 reads in the event loop
+    bool read_ring;             // read ahead with io_uring if the kernel allows it
+    log_level log_level;        // records below it are not logged
+    const char* metrics_path;   // unix socket the metrics are read from, NULL for none
+    bool uploads;               // WRQs are taken, refused otherwise
+    single_mode single_block;   // files that fit in one block are sent without a transfer
+    uint32_t min_timeout;       // milliseconds, bounds of the timeout estimated for a client
+    uint32_t max_timeout;
+    uint32_t max_resends;       // of the same window or reply before a client is given up on
+} server_config;
+
+typedef struct
+{
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    sockaddr_in* addresses;
+    int32_t* fds;       // socket each packet goes out on, send batch only
+    bool* zero_copy;    // sent with MSG_ZEROCOPY, send batch only
+    struct mmsghdr* joined; // messages as sent, see join_packets, send batch only
+    uint32_t* segments; // datagrams in each joined message, send batch only
+    char* controls;     // UDP_SEGMENT of each joined message, send batch only
+    uint32_t count;
+    uint64_t calls;     // number of recvmmsg/sendmmsg calls
+    uint64_t messages;  // number of messages they moved
+    uint64_t packets;   // number of datagrams in those
+} packet_batch;
+
+typedef struct
+{
+    int32_t fd;                 // -1 if io_uring is not used
+    uint32_t* sq_head;          // shared with the kernel
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    struct io_uring_sqe* sqes;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;              // the mappings, for munmap
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} read_ring;
+
+typedef struct read_job
+{
+    struct read_job* next;
+    struct server_info* server; // worker to hand it back to
+    client_value* client;
+    io_kind kind;               // a read ahead, a write or sync of an upload, or a conversion
+    cached_file* file;          // converted to netascii, held until it is done
+    char* start;                // page aligned range to fault in, or the chunk to write
+    size_t size;
+    uint64_t offset;            // in the file, of a write
+    int32_t fd;                 // file written or synced
+    uint32_t chunk;             // of the upload to write
+    int32_t result;             // 0 or -errno of a write or sync
+} read_job;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    read_job* head;             // queue of reads
+    read_job* tail;
+    pthread_t* threads;
+    uint32_t count;
+    bool stopping;
+} reader_pool;
+
+typedef struct
+{
+    uint64_t sequence;          // position it is free for, that + 1 once written
+    uint32_t size;
+    char line[LOG_LINE];        // the record, ending in a line break
+} log_record;
+
+typedef struct
+{
+    log_record* records;        // NULL until init_log, nothing is logged then
+    uint64_t mask;
+    uint64_t head;              // next position for a worker to claim
+    uint64_t tail;              // next position for the log thread to write out
+    uint64_t written;
+    uint64_t dropped;           // records lost to a full ring
+    log_level level;
+    int32_t wake;               // eventfd, signalled to stop the log thread
+    bool stopping;
+    pthread_t thread;
+} log_ring;
+
+typedef struct
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];     // see histogram_bucket
+    uint64_t sum;               // of every value, microseconds
+    uint64_t total;             // number of values
+} histogram;
+
+typedef struct
+{
+    uint64_t requests;          // RRQs
+    uint64_t ended[4];          // transfers by transfer_result
+    uint64_t errors[8];         // error packets sent by error_code
+    uint64_t retransmits;       // blocks sent again
+    uint64_t timeouts;          // windows sent again when the timer ran out
+    uint64_t bytes_sent;        // payload of every DATA block, sent again too
+    histogram duration;         // RRQ to the last ACK of a finished transfer
+    histogram first_block;      // RRQ to its first OACK or DATA block being queued, see first_reply
+    histogram ack_rtt;          // DATA block to its ACK, or an upload's ACK to the next block, see time_ack
+    uint64_t uploads;           // WRQs
+    uint64_t bytes_received;    // payload of every DATA block taken in uploads
+    uint64_t bytes_written;     // to uploaded files
+    histogram upload_duration;  // WRQ to the uploaded file being in place
+    histogram write_time;       // a chunk of an upload, from its write starting to done
+    uint64_t single_blocks;     // RRQs answered without a transfer, see send_single
+    uint64_t stray_acks;        // ACK 1s from clients no single block was sent to, see acknowledge_single
+    histogram srtt;             // smoothed round trip of each ended transfer that has one
+} worker_metrics;
+
+typedef struct
+{
+    struct server_info* servers;
+    uint32_t count;
+    int32_t listen_fd;          // unix socket, -1 without -s
+    int32_t signal_fd;          // SIGUSR1
+    int32_t wake;               // eventfd, signalled to stop the thread
+    pthread_t thread;
+} metrics_reporter;
+
+typedef struct server_info
+{
+    const server_config* config;
+    file_cache* cache;
+    uint32_t worker_id;
+    pthread_t thread;
     int32_t fd;
+    int32_t epoll_fd;
+    event_source listener;
+    event_source timer;
+    event_source shutdown;
+    timer_wheel wheel;
     sockaddr_in address;
-    sockaddr_in received_from;
-    char input[516];
+    packet_batch in;
+    packet_batch out;
+    uint64_t flushes;
+    bool zero_copy_sends;       // large blocks are sent with MSG_ZEROCOPY
+    uint32_t max_segment;       // largest datagram joined with UDP GSO, 0 for none
+    uint64_t now;               // milliseconds, updated on every wakeup and batch received
+    uint64_t now_us;            // microseconds, read with now
+    worker_metrics metrics;     // written by the worker only, see METRIC_ADD
+    client_slab slab;
+    client_value* closed;       // removed clients, freed after the events at hand
+    event_source reads_done;    // eventfd, signalled when reads ahead or writes are done
+    read_ring ring;             // fd is -1 if the reader threads are used
+    reader_pool* readers;       // NULL with -r 0, only converts netascii if the ring reads ahead
+    pthread_mutex_t done_lock;
+    read_job* done;             // reads handed back by the reader threads
+    uint32_t reads_in_flight;
+    uint32_t writes_in_flight;  // writes and syncs of uploads
+    uint64_t ranges_read;       // handed to io_uring or a reader
+    uint64_t read_stalls;       // times a transfer had to wait for one
+    uint64_t chunks_written;
+    uint64_t write_stalls;      // times an upload's ACK had to wait for a write
+    char* inputs;
+    int32_t reply_fd;           // socket the current packet came in on
+    sockaddr_in* received_from; // NULL if that socket is connected
+    sockaddr_in* peer;          // who sent it either way, for the log
+    char* input;
+    size_t input_size;
+    char* scratch;              // a block read from file, converted to netascii from here
+    sockaddr_in* faulted;       // clients whose blocks could not be sent, see drop_faulted
+    uint32_t faulted_count;
+    single_record* singles;     // SINGLE_RECORDS by client address, NULL unless -f record
+    single_sent* sent;          // SINGLE_RECORDS by client address, blocks sent without a record, NULL without -f
+    cached_file** held;         // files queued packets point into, released after the flush
+    uint32_t held_count;
 } server_info;
 
 /////////////
 // Globals //
 /////////////
-static bool server_loop = true;
+static volatile sig_atomic_t server_loop = true;
+static int32_t shutdown_fd = -1;
+static bool have_openat2 = true;        // false on kernels before 5.6, see open_beneath
+static size_t (*find_line_break)(const char* data, size_t size) = NULL;  // see init_netascii
+static char data_headers[65536][4];     // DATA header of each block number, see init_data_headers
+static log_ring server_log;             // see log_event
+static uint32_t upload_names = 0;       // temporary files made, see create_upload
+static const char* log_levels[] = { "debug", "info", "warn", "error" };
+static const char* single_modes[] = { "off", "record", "stateless" };
+static const char* transfer_results[] = { "done", "timeout", "error", "cancelled" };
 static const error_pack error_packs[] =
 {
     {1280, 0,    "Undefined",              13},  // htons(0) = 0
@@ -119,24 +625,171 @@ static const error_pack error_packs[] =
 /////////////////////////
 void int_handler(int32_t signal);
 void exit_error(const char* str);
-void start_server(server_info* server, char** argv);
+void parse_arguments(int32_t argc, char** argv, server_config* config);
+void start_server(const server_config* config);
+void* run_worker(void* arg);
 void init_server(const char* port, server_info* server);
+void close_server(server_info* server);
+void init_batches(server_info* server);
+void destroy_batches(server_info* server);
+void print_batch_stats(server_info* servers, uint32_t count);
+void init_cache(file_cache* cache, const char* root, uint64_t budget);
+void destroy_cache(file_cache* cache);
+void print_cache_stats(file_cache* cache);
+void print_read_stats(server_info* servers, uint32_t count);
+cached_file* lookup_file(file_cache* cache, const char* path, bool* missing);
+cached_file* acquire_file(file_cache* cache, const char* path, int32_t fd, struct stat* file_stat);
+void touch_file(file_cache* cache, cached_file* file);
+void init_index(file_cache* cache);
+void stop_index(file_cache* cache);
+void* run_index(void* arg);
+void apply_index_event(file_cache* cache, const struct inotify_event* event, GQueue* added);
+void rebuild_index(file_cache* cache);
+void index_added(file_cache* cache, GQueue* added);
+void init_index_tables(file_index* index);
+void merge_index(file_index* index, file_index* scan);
+bool index_tree(file_cache* cache, file_index* index, const char* top);
+bool index_directory(file_cache* cache, file_index* index, const char* dir, GQueue* pending);
+void index_path(file_cache* cache, const char* name, GQueue* added);
+void unindex_path(file_index* index, const char* name);
+index_entry* put_entry(file_index* index, const char* name, const struct stat* file_stat);
+bool is_below(const char* name, const char* dir, size_t length);
+bool canonical_name(const char* name);
+bool below_link(file_index* index, const char* name);
+cached_file* map_file(int32_t fd, struct stat* file_stat);
+bool prepare_netascii(cached_file* file, int32_t fd);
+bool read_copy(cached_file* file, int32_t fd, char* copy);
+bool queue_conversion(server_info* server, cached_file* file);
+void convert_file(cached_file* file);
+void release_file(cached_file* file);
+void drop_file(file_cache* cache, cached_file* file);
+void evict_files(file_cache* cache);
+void free_file(cached_file* file);
+void init_event_loop(server_info* server);
+void watch_event_source(server_info* server, event_source* source, uint32_t events);
+void handle_timer(client_table* clients, server_info* server);
+void handle_packet(client_table* clients, server_info* server);
+void handle_transfer_event(client_table* clients, server_info* server, client_value* client);
+bool handle_transfer_packet(client_table* clients, server_info* server, client_value* client);
+void remove_client(client_table* clients, server_info* server, client_value* client, transfer_result result);
+void free_closed_clients(server_info* server);
+void drop_faulted(client_table* clients, server_info* server);
+void handle_reads(client_table* clients, server_info* server);
+void finish_read(client_table* clients, server_info* server, client_value* client);
+void wait_for_reads(client_table* clients, server_info* server);
 uint16_t convert_port(const char* port_string);
-bool some_waiting(server_info* server);
-gboolean timed_out(gpointer key, gpointer value, gpointer user_data);
-guint client_hash(const void* key);
-gboolean client_equals(const void* lhs, const void* rhs);
-sockaddr_in* sockaddr_cpy(sockaddr_in* src);
-void socket_listener(server_info* server);
-void ip_message(sockaddr_in* client, bool greeting);
+uint64_t monotonic_us(void);
+void expire_client(client_table* clients, server_info* server, client_value* client);
+void init_wheel(timer_wheel* wheel, int32_t fd, uint64_t now);
+void schedule_timer(timer_wheel* wheel, timer_entry* entry, uint64_t expires);
+void cancel_timer(timer_entry* entry);
+void place_timer(timer_wheel* wheel, timer_entry* entry, uint64_t when);
+void advance_wheel(timer_wheel* wheel, uint64_t now, timer_entry* expired);
+void cascade_slot(timer_wheel* wheel, uint32_t level, uint32_t slot);
+uint64_t next_wheel_expiry(timer_wheel* wheel);
+void arm_wheel(timer_wheel* wheel, uint64_t when);
+void init_table(client_table* table, uint32_t capacity);
+void destroy_table(client_table* table);
+uint32_t hash_address(const sockaddr_in* address);
+table_slot* find_client_slot(client_table* table, const sockaddr_in* address);
+client_value* lookup_client(client_table* table, const sockaddr_in* address);
+void insert_client(client_table* table, table_slot* slot, client_value* client);
+void remove_client_slot(client_table* table, table_slot* slot);
+uint32_t socket_listener(server_info* server, int32_t fd);
+bool open_transfer_socket(server_info* server, client_value* client);
+void reply_to_client(server_info* server, client_value* client);
+void queue_packet(server_info* server, int32_t fd, void* buffer, size_t size, sockaddr_in* to);
+void queue_block(server_info* server, int32_t fd, block_slot* slot, sockaddr_in* to);
+void flush_packets(server_info* server);
+uint32_t join_packets(server_info* server, uint32_t first, uint32_t end, uint32_t at);
+size_t packet_size(packet_batch* batch, uint32_t i);
+void enable_zero_copy(server_info* server, int32_t fd);
+bool read_completions(int32_t fd);
+void format_address(const sockaddr_in* address, char* buffer);
+void log_transfer(server_info* server, client_value* client, transfer_result result);
 void send_error(server_info* server, error_code err);
-void start_new_transfer(GHashTable* clients, server_info* server, char* root);
-void continue_existing_transfer(GHashTable* clients, server_info* server);
-void read_to_buffer(client_value* client);
-size_t construct_full_path(char* dest, const char* root, const char* file_name);
+void start_new_transfer(client_table* clients, server_info* server);
+bool send_single(server_info* server, cached_file* file, mode md, bool converted, transfer_options* options, const char* name);
+bool acknowledge_single(server_info* server);
+single_record* find_single(server_info* server, const sockaddr_in* address);
+void free_single(server_info* server, single_record* record);
+void hold_file(server_info* server, cached_file* file);
+void continue_existing_transfer(client_table* clients, server_info* server);
+bool acknowledge_block(client_table* clients, server_info* server, client_value* client);
+void start_upload(client_table* clients, server_info* server);
+void continue_upload(client_table* clients, server_info* server);
+bool receive_block(client_table* clients, server_info* server, client_value* client);
+void store_payload(server_info* server, client_value* client, const char* data, size_t size);
+void append_upload(server_info* server, client_value* client, const char* data, size_t size);
+bool has_room(client_value* client);
+void write_chunk(server_info* server, client_value* client);
+void start_io(server_info* server, client_value* client, io_kind kind, uint32_t chunk);
+int32_t run_upload_io(int32_t fd, io_kind kind, const char* data, size_t size, uint64_t offset);
+void complete_io(server_info* server, client_value* client, io_kind kind, uint32_t chunk, int32_t result);
+void finish_write(client_table* clients, server_info* server, client_value* client, io_kind kind, uint32_t chunk, int32_t result);
+bool advance_upload(client_table* clients, server_info* server, client_value* client);
+bool finish_upload(client_table* clients, server_info* server, client_value* client);
+void acknowledge_upload(server_info* server, client_value* client);
+void send_upload_reply(server_info* server, client_value* client);
+void expire_upload(client_table* clients, server_info* server, client_value* client);
+upload_state* create_upload(int32_t root_fd, const char* path, int32_t* err);
+void discard_upload(upload_state* upload);
+error_code upload_error(int32_t err);
+void parse_options(server_info* server, size_t offset, transfer_options* options);
+void build_oack(client_value* client, transfer_options* options);
+size_t format_oack(char* buffer, transfer_options* options);
+size_t append_option(char* buffer, size_t offset, const char* name, uint64_t value);
+void send_window(server_info* server, client_value* client);
+void first_reply(server_info* server, client_value* client);
+bool find_acked_block(client_value* client, uint16_t block_number, uint64_t* block);
+uint16_t wire_block_number(uint64_t block);
+void read_to_buffer(server_info* server, client_value* client, block_slot* slot, uint64_t block);
+void init_data_headers(void);
+bool read_ahead(server_info* server, client_value* client);
+bool is_resident(const char* data, uint64_t size);
+bool start_read(server_info* server, client_value* client, uint64_t end);
+bool submit_ring(server_info* server, const struct io_uring_sqe* request);
+void queue_job(reader_pool* pool, read_job* job);
+void init_reads(server_info* server);
+bool init_ring(read_ring* ring, uint32_t capacity, int32_t event_fd);
+bool can_populate_read(void);
+void destroy_ring(read_ring* ring);
+void init_readers(reader_pool* pool, uint32_t count);
+void stop_readers(reader_pool* pool);
+void* run_reader(void* arg);
+void init_log(log_ring* log, log_level level);
+void stop_log(log_ring* log);
+void* run_log(void* arg);
+bool logging(log_level level);
+void log_event(log_level level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+size_t log_prefix(char* line, log_level level);
+void write_all(int32_t fd, const char* data, size_t size);
+void print_log_stats(log_ring* log);
+uint32_t histogram_bucket(uint64_t value);
+uint64_t bucket_limit(uint32_t bucket);
+void record_value(histogram* h, uint64_t value);
+void time_ack(server_info* server, client_value* client, uint64_t acked);
+void estimate_timeout(const server_config* config, client_value* client, uint64_t rtt);
+void back_off(const server_config* config, client_value* client);
+uint64_t bound_timeout(const server_config* config, uint64_t timeout);
+void init_metrics(metrics_reporter* reporter, server_info* servers, uint32_t count, const char* path);
+void stop_metrics(metrics_reporter* reporter, const char* path);
+void* run_metrics(void* arg);
+void write_metrics(metrics_reporter* reporter, int32_t fd);
+void print_histogram(FILE* out, const char* name, const char* help, histogram* merged);
+void init_netascii(void);
+size_t netascii_convert(const char* src, size_t src_size, size_t* consumed, char* dest, size_t dest_size, char* carry);
+uint64_t netascii_size(const char* data, uint64_t size);
+size_t netascii_decode(const char* src, size_t size, char* dest, bool* carry);
+size_t find_line_break_scalar(const char* data, size_t size);
+size_t find_line_break_sse2(const char* data, size_t size);
+size_t find_line_break_avx2(const char* data, size_t size);
+int32_t open_beneath(int32_t root_fd, const char* name, int32_t flags);
 int32_t get_mode(char* str);
-void destroy_value(gpointer data);
-client_value* init_client(mode m);
+void init_slab(client_slab* slab, uint32_t capacity);
+void destroy_slab(client_slab* slab);
+void free_client(client_slab* slab, client_value* client);
+client_value* init_client(client_slab* slab, const server_config* config, mode m, transfer_options* options, bool zero_copy);
 
 ///////////////
 // Functions //
@@ -150,659 +803,5982 @@ int32_t main(int32_t argc, char **argv)
     // Override ctrl+c
     signal(SIGINT, int_handler);
     
-    // Excessive are ignored but 3 needed to run server
-    if (argc < 3)
-    {
-        exit_error("Invalid arguments!\n");
-    }
+    // Options first, then port and root. Excessive are ignored.
+    server_config config;
+    parse_arguments(argc, argv, &config);
 
-    // Start server
-    server_info server;
-    start_server(&server, argv);
+    // Pick the fastest netascii conversion this CPU can run
+    init_netascii();
+    init_data_headers();
 
-    // Close socket
-    close(server.fd);
+    // Start server, returns once all workers have stopped
+    start_server(&config);
 
     return 0;
 }
 
 /*
- * Server starting point, includes main loop.
+ * Read options and the two positional arguments, port and root.
  */
-void start_server(server_info* server, char** argv)
+void parse_arguments(int32_t argc, char** argv, server_config* config)
 {
-    fprintf(stdout, "Setting up server...\n");
-
-    // Set up socket
-    init_server(argv[1], server);
-
-    fprintf(stdout, "Server setup complete...\n");
-
-    // Collection for clients
-    GHashTable* clients = g_hash_table_new_full(client_hash, client_equals, free, destroy_value);
-
-    fprintf(stdout, "Starting server loop...\n");
-    fprintf(stdout, "Listening on port %s...\n", argv[1]);
-    fflush(stdout);
+    config->batch_size = DEFAULT_BATCH_SIZE;
+    config->workers = 1;
+    config->transfer_sockets = false;
+    config->cache_size = (uint64_t)DEFAULT_CACHE_SIZE << 20;
+    config->max_transfers = DEFAULT_MAX_TRANSFERS;
+    config->readers = DEFAULT_READERS;
+    config->read_ring = true;
+    config->log_level = INFO_LEVEL;
+    config->metrics_path = NULL;
+    config->uploads = false;
+    config->single_block = SINGLE_OFF;
+    config->min_timeout = DEFAULT_MIN_TIMEOUT;
+    config->max_timeout = DEFAULT_MAX_TIMEOUT;
+    config->max_resends = DEFAULT_RESENDS;
 
-    // Runs until interupted by SIGINT
-    while(server_loop) 
+    int32_t opt;
+    while ((opt = getopt(argc, argv, "b:c:e:f:j:l:m:r:s:tu")) != -1)
     {
-        // Check if any packets are in the socket, if not...
-        if (!some_waiting(server))
-        {
-            //fprintf(stdout, "DEBUG: Inactive\n"); fflush(stdout);
-
-            // Time out inactive clients
-            g_hash_table_foreach_remove(clients, timed_out, server);
-            continue;
-        }
-
-        // Retrieve what is on the socket
-        socket_listener(server);
-
-        // If first byte is not 0, then opcode is more than 1<<8 
-        // and we set the second byte to send an error message
-        if (server->input[0]) 
-        {
-            server->input[1] = NONE;
-        }
-
-        switch (server->input[1] /* Opcode */)
+        switch (opt)
         {
-            case RRQ:
-                //fprintf(stdout, "DEBUG: PACK = RRQ\n"); fflush(stdout);
-                start_new_transfer(clients, server, argv[2]);
+            case 'b':
+                config->batch_size = strtoul(optarg, NULL, 0);
+                if (config->batch_size == 0 || config->batch_size > MAX_BATCH_SIZE)
+                {
+                    exit_error("Invalid batch size!\n");
+                }
+                break;
+            case 'c':
+            {
+                uint64_t megabytes = strtoull(optarg, NULL, 0);
+                if (megabytes > MAX_CACHE_SIZE)
+                {
+                    exit_error("Invalid cache size!\n");
+                }
+                config->cache_size = megabytes << 20;
+                break;
+            }
+            case 'e':
+            {
+                // min_ms:max_ms:resends, any of them may be left out
+                char* end = optarg;
+                if (*end != ':')
+                {
+                    config->min_timeout = strtoul(end, &end, 0);
+                }
+                if (*end == ':' && *++end != ':' && *end != '\0')
+                {
+                    config->max_timeout = strtoul(end, &end, 0);
+                }
+                if (*end == ':' && *++end != '\0')
+                {
+                    config->max_resends = strtoul(end, &end, 0);
+                }
+                if (*end != '\0' || config->min_timeout == 0 || config->min_timeout > config->max_timeout ||
+                    config->max_timeout > MAX_CLIENT_TIMEOUT * 1000 || config->max_resends > MAX_RESENDS)
+                {
+                    exit_error("Invalid resend bounds!\n");
+                }
+                break;
+            }
+            case 'f':
+            {
+                uint32_t single = 0;
+                while (single <= SINGLE_STATELESS && strcmp(optarg, single_modes[single]))
+                {
+                    single++;
+                }
+                if (single > SINGLE_STATELESS)
+                {
+                    exit_error("Invalid single block mode!\n");
+                }
+                config->single_block = (single_mode)single;
+                break;
+            }
+            case 'j':
+                config->workers = strtoul(optarg, NULL, 0);
+                if (config->workers == 0 || config->workers > MAX_WORKERS)
+                {
+                    exit_error("Invalid worker count!\n");
+                }
+                break;
+            case 'l':
+            {
+                uint32_t level = 0;
+                while (level <= ERROR_LEVEL && strcmp(optarg, log_levels[level]))
+                {
+                    level++;
+                }
+                if (level > ERROR_LEVEL)
+                {
+                    exit_error("Invalid log level!\n");
+                }
+                config->log_level = (log_level)level;
+                break;
+            }
+            case 'm':
+                config->max_transfers = strtoul(optarg, NULL, 0);
+                if (config->max_transfers == 0 || config->max_transfers > MAX_TRANSFERS)
+                {
+                    exit_error("Invalid transfer limit!\n");
+                }
+                break;
+            case 'r':
+                config->readers = strtoul(optarg, NULL, 0);
+                if (config->readers > MAX_READERS)
+                {
+                    exit_error("Invalid reader count!\n");
+                }
+                break;
+            case 's':
+                config->metrics_path = optarg;
                 break;
-            case ACK:
-                //fprintf(stdout, "DEBUG: PACK = ACK\n"); fflush(stdout);
-                continue_existing_transfer(clients, server);
+            case 't':
+                config->transfer_sockets = true;
                 break;
-            case ERR:
-                //fprintf(stdout, "DEBUG: PACK = ERR\n"); fflush(stdout);
-                g_hash_table_remove(clients, &server->received_from);
+            case 'u':
+                config->uploads = true;
                 break;
             default:
-                //fprintf(stdout, "DEBUG: PACK = UNKNOWN\n"); fflush(stdout);
-                send_error(server, ACCESS_VIOLATION);
+                fprintf(stderr, "Usage: %s [-b batch_size] [-c cache_mb] [-e min_ms:max_ms:resends] [-f single_block] [-j workers] [-l level] [-m max_transfers] [-r readers] [-s metrics_socket] [-t] [-u] <port> <root>\n", argv[0]);
+                exit(EXIT_FAILURE);
         }
     }
 
-    g_hash_table_destroy(clients);
+    // 2 needed to run server
+    if (argc - optind < 2)
+    {
+        exit_error("Invalid arguments!\n");
+    }
+
+    config->port = argv[optind];
+    config->root = argv[optind + 1];
 }
 
 /*
- * Signal listener for SIGINT.
+ * Server starting point. Sets up one socket per worker, all bound to
+ * the same port with SO_REUSEPORT, and runs each worker in its own
+ * thread. The kernel hashes every client to one of the sockets so a
+ * transfer always stays on the same worker and they share nothing.
  */
-void int_handler(int signal)
+void start_server(const server_config* config)
 {
-    if (signal == SIGINT)
+    fprintf(stdout, "Setting up server...\n");
+
+    // Written to from the SIGINT handler to wake up every worker
+    shutdown_fd = eventfd(0, EFD_NONBLOCK);
+    if (ERROR(shutdown_fd))
     {
-        server_loop = false;
+        exit_error("Failed to create shutdown event!\n");
+    }
 
-        fprintf(stdout, "Terminating server shortly...\n");
-        fflush(stdout);
+    // One file cache for all workers
+    file_cache cache;
+    init_cache(&cache, config->root, config->cache_size);
+
+    // Set up sockets
+    server_info* servers = (server_info*)calloc(config->workers, sizeof(server_info));
+    if (servers == NULL)
+    {
+        exit_error("Failed to allocate workers!\n");
+    }
+    for (uint32_t i = 0; i < config->workers; i++)
+    {
+        servers[i].config = config;
+        servers[i].cache = &cache;
+        servers[i].worker_id = i;
+        init_server(config->port, &servers[i]);
     }
-}
 
-/*
- * For abnormal terminations of program.
- */
-void exit_error(const char* str) 
-{
-    perror(str);
+    // Workers that could not get an io_uring read ahead with threads
+    uint32_t without_ring = 0;
+    for (uint32_t i = 0; i < config->workers; i++)
+    {
+        if (config->readers > 0 && servers[i].ring.fd < 0)
+        {
+            without_ring++;
+        }
+    }
 
-    fprintf(stdout, "Exiting...\n");
+    fprintf(stdout, "Server setup complete...\n");
+    fprintf(stdout, "Starting %u server loop%s...\n", config->workers, config->workers == 1 ? "" : "s");
+    fprintf(stdout, "Listening on port %s...\n", config->port);
     fflush(stdout);
-    
-    exit(EXIT_FAILURE);
-}
 
-/*
- * Create and bind socket.
- */
-void init_server(const char* port, server_info* server) 
-{
-    // domain = v4, type = UDP, protocol = default
-    server->fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (ERROR(server->fd))
+    // SIGUSR1 asks for the metrics. The metrics thread reads it from a
+    // signalfd, so no thread may take it as a signal.
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+    // Only the main thread should handle SIGINT, workers inherit the mask
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    init_log(&server_log, config->log_level);
+    metrics_reporter metrics;
+    init_metrics(&metrics, servers, config->workers, config->metrics_path);
+    init_index(&cache);
+    // Workers with an io_uring read ahead with it, and still convert 
+    // files to netascii with the reader threads
+    reader_pool readers;
+    if (config->readers > 0)
     {
-        exit_error("Failed to create socket!\n");
+        init_readers(&readers, config->readers);
+        for (uint32_t i = 0; i < config->workers; i++)
+        {
+            servers[i].readers = &readers;
+        }
+    }
+    if (without_ring > 0)
+    {
+        fprintf(stdout, "Reading ahead with %u reader thread%s...\n", config->readers, config->readers == 1 ? "" : "s");
+    }
+    if (config->readers > 0 && without_ring < config->workers)
+    {
+        fprintf(stdout, "Reading ahead with io_uring, converting netascii with %u reader thread%s...\n", 
+            config->readers, config->readers == 1 ? "" : "s");
+    }
+    fflush(stdout);
+    for (uint32_t i = 0; i < config->workers; i++)
+    {
+        if (pthread_create(&servers[i].thread, NULL, run_worker, &servers[i]) != 0)
+        {
+            exit_error("Failed to start worker!\n");
+        }
     }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
 
-    memset(&server->address, 0, sizeof(sockaddr_in));
-    server->address.sin_family = AF_INET;                   // address familty = v4
-    server->address.sin_port = htons(convert_port(port));   // port in network byte order
-    server->address.sin_addr.s_addr = htonl(INADDR_ANY);    // all available interfaces
-    
-    if (ERROR(bind(server->fd, (sockaddr*)&server->address, (socklen_t)sizeof(sockaddr_in))))
+    for (uint32_t i = 0; i < config->workers; i++)
     {
-        exit_error("Failed to bind socket!\n");
+        pthread_join(servers[i].thread, NULL);
     }
-}
+    if (config->readers > 0)
+    {
+        stop_readers(&readers);
+    }
+    stop_index(&cache);
+    stop_metrics(&metrics, config->metrics_path);
+    stop_log(&server_log);
 
-/*
- * Convert port as string to an unsigned short.
- */
-uint16_t convert_port(const char* port_string)
-{
-    int32_t port = strtoul(port_string, NULL, 0);
-    if (errno == ERANGE || port == 0 || port > 65535)
+    print_batch_stats(servers, config->workers);
+    print_cache_stats(&cache);
+    print_read_stats(servers, config->workers);
+    print_log_stats(&server_log);
+
+    for (uint32_t i = 0; i < config->workers; i++)
     {
-        exit_error("Invalid port!\n");
+        close_server(&servers[i]);
     }
-    return (uint16_t)port;
+    free(servers);
+    destroy_cache(&cache);
+    close(shutdown_fd);
 }
 
 /*
- * Check if there is data in the socket.
+ * Worker thread, the main loop. Each worker has its own socket, 
+ * event loop and pool of clients.
  */
-bool some_waiting(server_info* server)
+void* run_worker(void* arg)
 {
-    // Set inactive timer
-    struct timeval tv;
-    tv.tv_sec = INACTIVE_TIMER;
-    tv.tv_usec = 0;
+    server_info* server = (server_info*)arg;
+    const server_config* config = server->config;
 
-    // Create, restart and add server fd to set
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET(server->fd, &rfds);
-    
-    int32_t s = select(server->fd + 1, &rfds, NULL, NULL, &tv);
-    if (ERROR(s))
+    // Collection for clients, keyed by the address in the client. It has
+    // room for every client the slab can hand out.
+    client_table table;
+    init_table(&table, server->slab.capacity);
+    client_table* clients = &table;
+
+    // Runs until interupted by SIGINT
+    struct epoll_event events[MAX_EVENTS];
+    while(server_loop) 
+    {
+        // Block until the socket or the timer has something for us
+        int32_t n = epoll_wait(server->epoll_fd, events, MAX_EVENTS, -1);
+        if (ERROR(n))
+        {
+            if (errno == EINTR) continue;
+            exit_error("Epoll wait failed\n");
+        }
+        server->now_us = monotonic_us();
+        server->now = server->now_us / 1000;
+
+        for (int32_t i = 0; i < n; i++)
+        {
+            event_source* source = (event_source*)events[i].data.ptr;
+            switch (source->type)
+            {
+                case LISTENER_EVENT:
+                {
+                    // Zero copy completions, see read_completions
+                    if ((events[i].events & EPOLLERR) && !read_completions(server->fd))
+                    {
+                        server->zero_copy_sends = false;
+                    }
+
+                    // Edge triggered, so we must drain the socket. A batch that 
+                    // comes back short means the socket was empty at that point.
+                    uint32_t received;
+                    do
+                    {
+                        received = socket_listener(server, server->fd);
+                        for (uint32_t j = 0; j < received; j++)
+                        {
+                            server->input = server->inputs + j * INPUT_SIZE;
+                            server->input_size = server->in.msgs[j].msg_len;
+                            server->reply_fd = server->fd;
+                            server->received_from = &server->in.addresses[j];
+                            server->peer = server->received_from;
+                            handle_packet(clients, server);
+                        }
+                        flush_packets(server);
+                    } while (received == config->batch_size);
+                    break;
+                }
+                case TRANSFER_EVENT:
+                {
+                    client_value* client = CONTAINER_OF(source, client_value, event);
+                    if ((events[i].events & EPOLLERR) && client->event.fd >= 0 && !read_completions(client->event.fd))
+                    {
+                        server->zero_copy_sends = false;
+                    }
+                    handle_transfer_event(clients, server, client);
+                    flush_packets(server);
+                    break;
+                }
+                case TIMER_EVENT:
+                    handle_timer(clients, server);
+                    flush_packets(server);
+                    break;
+                case READ_EVENT:
+                    handle_reads(clients, server);
+                    flush_packets(server);
+                    break;
+                case SHUTDOWN_EVENT:
+                    // Never read, so it stays readable for all workers
+                    break;
+            }
+        }
+
+        // Events still to be handled may have pointed at these
+        drop_faulted(clients, server);
+        free_closed_clients(server);
+    }
+
+    // Readers may still be faulting in files of clients we are about to free
+    wait_for_reads(clients, server);
+    for (uint32_t i = 0; i <= clients->mask; i++)
     {
-    	if (!server_loop) return false;
-        exit_error("Select failed\n");
+        if (clients->slots[i].client != NULL)
+        {
+            free_client(&server->slab, clients->slots[i].client);
+        }
     }
-    
-    return s > 0 && FD_ISSET(server->fd, &rfds);
+    destroy_table(clients);
+    free_closed_clients(server);
+    return NULL;
 }
 
 /*
- * Timeout checker for hash table iteration. Returns true iff 
- * timed out which leads to it being removed from the hash table.
+ * Process a single packet that was read into the server's input buffer.
  */
-gboolean timed_out(gpointer key, gpointer value, gpointer user_data)
+void handle_packet(client_table* clients, server_info* server)
 {
-    // Pointer casting
-    sockaddr_in* client_key = (sockaddr_in*)key;
-    client_value* client_val = (client_value*)value;
-    server_info* server = (server_info*)user_data;
-    
-    time_t now = time(NULL);
-    if (difftime(now, client_val->last_action) >= CLIENT_TIMEOUT)
+    // If first byte is not 0, then opcode is more than 1<<8 
+    // and we set the second byte to send an error message
+    if (server->input[0]) 
     {
-        // Send error to timed out client
-        memcpy(&server->received_from, client_key, sizeof(sockaddr_in));
-        send_error(server, UNDEFINED);
+        server->input[1] = NONE;
+    }
+
+    switch (server->input[1] /* Opcode */)
+    {
+        case RRQ:
+            //fprintf(stdout, "DEBUG: PACK = RRQ\n"); fflush(stdout);
+            start_new_transfer(clients, server);
+            break;
+        case WRQ:
+            start_upload(clients, server);
+            break;
+        case DATA:
+            continue_upload(clients, server);
+            break;
+        case ACK:
+            //fprintf(stdout, "DEBUG: PACK = ACK\n"); fflush(stdout);
+            continue_existing_transfer(clients, server);
+            break;
+        case ERR:
+        {
+            //fprintf(stdout, "DEBUG: PACK = ERR\n"); fflush(stdout);
+            client_value* client = lookup_client(clients, server->received_from);
+            single_record* record = client == NULL ? find_single(server, server->received_from) : NULL;
+            if (client != NULL)
+            {
+                remove_client(clients, server, client, CANCELLED_RESULT);
+            }
+            else if (record != NULL)
+            {
+                free_single(server, record);
+            }
+            break;
+        }
+        default:
+            //fprintf(stdout, "DEBUG: PACK = UNKNOWN\n"); fflush(stdout);
+            send_error(server, ACCESS_VIOLATION);
+    }
+}
+
+/*
+ * Read everything waiting on a transfer's own socket. The socket is
+ * connected, so the kernel only lets the client's packets through and
+ * the transfer comes from the event itself rather than the pool.
+ */
+void handle_transfer_event(client_table* clients, server_info* server, client_value* client)
+{
+    // Removed by an earlier event in the same wakeup
+    if (client->event.fd < 0)
+    {
+        return;
+    }
+
+    uint32_t received;
+    do
+    {
+        received = socket_listener(server, client->event.fd);
+        for (uint32_t j = 0; j < received; j++)
+        {
+            server->input = server->inputs + j * INPUT_SIZE;
+            server->input_size = server->in.msgs[j].msg_len;
+            reply_to_client(server, client);
+            if (!handle_transfer_packet(clients, server, client))
+            {
+                // Whatever is left was meant for the transfer we just ended
+                return;
+            }
+        }
+    } while (received == server->config->batch_size);
+}
+
+/*
+ * Process a single packet from a transfer's own socket. Returns false
+ * if the transfer is over and the client was removed.
+ */
+bool handle_transfer_packet(client_table* clients, server_info* server, client_value* client)
+{
+    // See handle_packet
+    if (server->input[0]) 
+    {
+        server->input[1] = NONE;
+    }
+
+    switch (server->input[1] /* Opcode */)
+    {
+        case ACK:
+            return acknowledge_block(clients, server, client);
+        case DATA:
+            return receive_block(clients, server, client);
+        case ERR:
+            remove_client(clients, server, client, CANCELLED_RESULT);
+            return false;
+        default:
+            // Also a new RRQ or WRQ, those go to the server's port
+            send_error(server, ILLEGAL_OP);
+            return true;
+    }
+}
+
+/*
+ * Take a client out of the pool, and count and log how the transfer
+ * ended, see log_transfer. Packets still queued may point into the client's buffer
+ * or go out on its socket, so they are sent first. An event for the 
+ * client may still be waiting in the current wakeup, so it is only
+ * freed once those are handled.
+ */
+void remove_client(client_table* clients, server_info* server, client_value* client, transfer_result result)
+{
+    METRIC_ADD(server->metrics.ended[result], 1);
+    if (result == DONE_RESULT && client->upload == NULL)
+    {
+        record_value(&server->metrics.duration, server->now_us - client->started);
+    }
+    if (client->srtt != 0)
+    {
+        record_value(&server->metrics.srtt, client->srtt);
+    }
+    log_transfer(server, client, result);
+    flush_packets(server);
+    cancel_timer(&client->timer);
+    if (client->event.fd >= 0)
+    {
+        close(client->event.fd);
+        client->event.fd = -1;
+    }
+
+    remove_client_slot(clients, find_client_slot(clients, &client->address));
+    client->link = server->closed;
+    server->closed = client;
+}
+
+/*
+ * Free clients that were removed since the last wakeup. A client with a
+ * read ahead or write in flight is kept until it is done, since its 
+ * file or chunks are still in use.
+ */
+void free_closed_clients(server_info* server)
+{
+    client_value** link = &server->closed;
+    while (*link != NULL)
+    {
+        client_value* client = *link;
+        if (client->reading != 0 || (client->upload != NULL && client->upload->in_flight > 0))
+        {
+            link = &client->link;
+            continue;
+        }
+        *link = client->link;
+        free_client(&server->slab, client);
+    }
+}
+
+/*
+ * End the transfers whose blocks the kernel could not read, which is 
+ * what happens when their mapped file was truncated under them. They 
+ * would only fail again on every resend. Their error packets do not 
+ * point into a mapping, so flushing them faults nothing new.
+ */
+void drop_faulted(client_table* clients, server_info* server)
+{
+    for (uint32_t i = 0; i < server->faulted_count; i++)
+    {
+        client_value* client = lookup_client(clients, &server->faulted[i]);
+        if (client == NULL || client->upload != NULL)
+        {
+            continue;
+        }
+        if (logging(WARN_LEVEL))
+        {
+            char address[ADDRESS_SIZE];
+            format_address(&client->address, address);
+            log_event(WARN_LEVEL, "event=send_fault client=%s block=%" PRIu64, address, client->base);
+        }
+        reply_to_client(server, client);
+        send_error(server, UNDEFINED);
+        remove_client(clients, server, client, ERROR_RESULT);
+    }
+    if (server->faulted_count > 0)
+    {
+        server->faulted_count = 0;
+        flush_packets(server);
+    }
+}
+
+/*
+ * Reads ahead or writes of uploads are done, by io_uring or the reader
+ * threads. Transfers that were waiting for them send the rest of their
+ * window, uploads move on, see finish_write.
+ */
+void handle_reads(client_table* clients, server_info* server)
+{
+    // Reading the count re-arms the edge for epoll
+    uint64_t count;
+    if (ERROR(read(server->reads_done.fd, &count, sizeof(count))))
+    {
+        if (errno == EAGAIN) return;
+        exit_error("Read event failed\n");
+    }
+
+    if (server->ring.fd >= 0)
+    {
+        read_ring* ring = &server->ring;
+        uint32_t head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            // The client with the kind and chunk in its low bits, see start_io
+            uint64_t data = ring->cqes[head & ring->cq_mask].user_data;
+            int32_t result = ring->cqes[head & ring->cq_mask].res;
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+            client_value* client = (client_value*)(uintptr_t)(data & ~(uint64_t)7);
+            if ((data & 3) == READ_IO)
+            {
+                finish_read(clients, server, client);
+            }
+            else
+            {
+                finish_write(clients, server, client, (io_kind)(data & 3), (data >> 2) & 1, result);
+            }
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&server->done_lock);
+    read_job* job = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&server->done_lock);
+    while (job != NULL)
+    {
+        read_job* next = job->next;
+        if (job->kind == READ_IO)
+        {
+            finish_read(clients, server, job->client);
+        }
+        else
+        {
+            finish_write(clients, server, job->client, job->kind, job->chunk, job->result);
+        }
+        free(job);
+        job = next;
+    }
+}
+
+/*
+ * A read ahead for client is done. Whether it worked or not is not 
+ * checked, if not the pages are faulted in when they are sent.
+ */
+void finish_read(client_table* clients, server_info* server, client_value* client)
+{
+    server->reads_in_flight--;
+    client->resident = client->reading;
+    client->reading = 0;
+
+    // Removed while it was reading, it is freed with the other closed ones
+    if (!server_loop || lookup_client(clients, &client->address) != client)
+    {
+        return;
+    }
+
+    if (client->stalled)
+    {
+        client->stalled = false;
+        reply_to_client(server, client);
+        send_window(server, client);
+    }
+}
+
+/*
+ * Block until every read ahead and write of this worker is done.
+ */
+void wait_for_reads(client_table* clients, server_info* server)
+{
+    while (server->reads_in_flight + server->writes_in_flight > 0)
+    {
+        struct pollfd ready = { server->reads_done.fd, POLLIN, 0 };
+        if (ERROR(poll(&ready, 1, -1)) && errno != EINTR)
+        {
+            exit_error("Failed to wait for reads\n");
+        }
+        handle_reads(clients, server);
+    }
+}
+
+/*
+ * Timer fired. Resend to clients whose deadline has passed and time 
+ * out those that have used up their resends. Only clients that are due 
+ * are looked at.
+ */
+void handle_timer(client_table* clients, server_info* server)
+{
+    // Reading the expiration count re-arms the edge for epoll
+    uint64_t expirations;
+    if (ERROR(read(server->timer.fd, &expirations, sizeof(expirations))))
+    {
+        if (errno == EAGAIN) return;
+        exit_error("Timer read failed\n");
+    }
+
+    // Collect everything due, then deal with it. Dealing with it may
+    // schedule the timers again.
+    server->now_us = monotonic_us();
+    server->now = server->now_us / 1000;
+    server->wheel.armed = UINT64_MAX;
+
+    timer_entry expired;
+    expired.next = expired.prev = &expired;
+    advance_wheel(&server->wheel, server->now, &expired);
+    while (expired.next != &expired)
+    {
+        timer_entry* entry = expired.next;
+        cancel_timer(entry);
+        expire_client(clients, server, CONTAINER_OF(entry, client_value, timer));
+    }
+
+    arm_wheel(&server->wheel, next_wheel_expiry(&server->wheel));
+}
+
+/*
+ * Signal listener for SIGINT.
+ */
+void int_handler(int signal)
+{
+    if (signal == SIGINT)
+    {
+        server_loop = false;
+
+        // Wake up all workers
+        uint64_t one = 1;
+        if (ERROR(write(shutdown_fd, &one, sizeof(one))))
+        {
+            // Nothing to be done, workers see the flag on their next event
+        }
+
+        fprintf(stdout, "Terminating server shortly...\n");
+        fflush(stdout);
+    }
+}
+
+/*
+ * For abnormal terminations of program.
+ */
+void exit_error(const char* str) 
+{
+    perror(str);
+
+    fprintf(stdout, "Exiting...\n");
+    fflush(stdout);
+    
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Create and bind socket.
+ */
+void init_server(const char* port, server_info* server) 
+{
+    // domain = v4, type = UDP, protocol = default
+    server->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (ERROR(server->fd))
+    {
+        exit_error("Failed to create socket!\n");
+    }
+
+    memset(&server->address, 0, sizeof(sockaddr_in));
+    server->address.sin_family = AF_INET;                   // address familty = v4
+    server->address.sin_port = htons(convert_port(port));   // port in network byte order
+    server->address.sin_addr.s_addr = htonl(INADDR_ANY);    // all available interfaces
+    
+    // Workers share the port, the kernel spreads clients between them
+    int32_t reuse = 1;
+    if (server->config->workers > 1 && 
+        ERROR(setsockopt(server->fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse))))
+    {
+        exit_error("Failed to set SO_REUSEPORT!\n");
+    }
+
+    if (ERROR(bind(server->fd, (sockaddr*)&server->address, (socklen_t)sizeof(sockaddr_in))))
+    {
+        exit_error("Failed to bind socket!\n");
+    }
+
+    // The limit on transfers is split evenly between workers
+    uint32_t workers = server->config->workers;
+    init_slab(&server->slab, (server->config->max_transfers + workers - 1) / workers);
+
+    server->zero_copy_sends = true;
+    enable_zero_copy(server, server->fd);
+
+    // Turning UDP GSO off for the socket tells if the kernel has it at all,
+    // sends ask for it per message
+    int32_t no_segments = 0;
+    server->max_segment = 4 + MAX_BLOCK_SIZE;
+    if (ERROR(setsockopt(server->fd, SOL_UDP, UDP_SEGMENT, &no_segments, sizeof(no_segments))))
+    {
+        server->max_segment = 0;
+    }
+
+    init_batches(server);
+    init_event_loop(server);
+    init_reads(server);
+
+    // Records only for OACKs, of a file sent at once only where it went
+    server->singles = NULL;
+    server->sent = NULL;
+    if (server->config->single_block == SINGLE_RECORD)
+    {
+        server->singles = (single_record*)calloc(SINGLE_RECORDS, sizeof(single_record));
+        if (server->singles == NULL)
+        {
+            exit_error("Failed to allocate single block records!\n");
+        }
+    }
+    if (server->config->single_block != SINGLE_OFF)
+    {
+        server->sent = (single_sent*)calloc(SINGLE_RECORDS, sizeof(single_sent));
+        if (server->sent == NULL)
+        {
+            exit_error("Failed to allocate single block records!\n");
+        }
+    }
+}
+
+/*
+ * Close event loop, timer and socket.
+ */
+void close_server(server_info* server)
+{
+    close(server->epoll_fd);
+    close(server->timer.fd);
+    close(server->fd);
+    for (uint32_t i = 0; server->singles != NULL && i < SINGLE_RECORDS; i++)
+    {
+        if (server->singles[i].address.sin_port != 0)
+        {
+            release_file(server->singles[i].file);
+        }
+    }
+    free(server->singles);
+    free(server->sent);
+    for (uint32_t i = 0; i < server->held_count; i++)
+    {
+        release_file(server->held[i]);
+    }
+    destroy_batches(server);
+    destroy_slab(&server->slab);
+    destroy_ring(&server->ring);
+    if (server->reads_done.fd >= 0)
+    {
+        close(server->reads_done.fd);
+        pthread_mutex_destroy(&server->done_lock);
+    }
+}
+
+/*
+ * Allocate the receive and send batches. Each receive slot has its own
+ * input buffer and address, each send slot just points at what to send,
+ * in up to two parts.
+ */
+void init_batches(server_info* server)
+{
+    uint32_t n = server->config->batch_size;
+
+    server->inputs = (char*)malloc(n * INPUT_SIZE);
+    server->in.msgs = (struct mmsghdr*)calloc(n, sizeof(struct mmsghdr));
+    server->in.iovs = (struct iovec*)calloc(n, sizeof(struct iovec));
+    server->in.addresses = (sockaddr_in*)calloc(n, sizeof(sockaddr_in));
+    server->out.msgs = (struct mmsghdr*)calloc(n, sizeof(struct mmsghdr));
+    server->out.iovs = (struct iovec*)calloc(2 * n, sizeof(struct iovec));
+    server->out.addresses = (sockaddr_in*)calloc(n, sizeof(sockaddr_in));
+    server->out.fds = (int32_t*)calloc(n, sizeof(int32_t));
+    server->out.zero_copy = (bool*)calloc(n, sizeof(bool));
+    server->out.joined = (struct mmsghdr*)calloc(n, sizeof(struct mmsghdr));
+    server->out.segments = (uint32_t*)calloc(n, sizeof(uint32_t));
+    server->out.controls = (char*)calloc(n, SEGMENT_CONTROL);
+    server->held = (cached_file**)calloc(2 * n, sizeof(cached_file*));
+    server->scratch = (char*)malloc(MAX_BLOCK_SIZE);
+    server->faulted = (sockaddr_in*)calloc(n, sizeof(sockaddr_in));
+    server->faulted_count = 0;
+    if (server->inputs == NULL || server->scratch == NULL || server->faulted == NULL || server->in.msgs == NULL || server->in.iovs == NULL || 
+        server->in.addresses == NULL || server->out.msgs == NULL || server->out.iovs == NULL || 
+        server->out.addresses == NULL || server->out.fds == NULL || server->out.zero_copy == NULL ||
+        server->out.joined == NULL || server->out.segments == NULL || server->out.controls == NULL ||
+        server->held == NULL)
+    {
+        exit_error("Failed to allocate batches!\n");
+    }
+
+    // Leave room for a terminating 0 at the end of each input
+    for (uint32_t i = 0; i < n; i++)
+    {
+        server->in.iovs[i].iov_base = server->inputs + i * INPUT_SIZE;
+        server->in.iovs[i].iov_len = INPUT_SIZE - 1;
+        server->in.msgs[i].msg_hdr.msg_iov = &server->in.iovs[i];
+        server->in.msgs[i].msg_hdr.msg_iovlen = 1;
+        server->in.msgs[i].msg_hdr.msg_name = &server->in.addresses[i];
+
+        server->out.msgs[i].msg_hdr.msg_iov = &server->out.iovs[2 * i];
+        server->out.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    server->in.count = server->out.count = server->held_count = 0;
+    server->flushes = 0;
+    server->closed = NULL;
+    server->in.calls = server->in.messages = server->in.packets = 0;
+    server->out.calls = server->out.messages = server->out.packets = 0;
+}
+
+/*
+ * Free the receive and send batches.
+ */
+void destroy_batches(server_info* server)
+{
+    free(server->inputs);
+    free(server->in.msgs);
+    free(server->in.iovs);
+    free(server->in.addresses);
+    free(server->out.msgs);
+    free(server->out.iovs);
+    free(server->out.addresses);
+    free(server->out.fds);
+    free(server->out.zero_copy);
+    free(server->out.joined);
+    free(server->out.segments);
+    free(server->out.controls);
+    free(server->held);
+    free(server->scratch);
+    free(server->faulted);
+}
+
+/*
+ * Report how full the batches were on average over all workers, for tuning -b,
+ * and how many datagrams each send call put out once UDP GSO joined them.
+ */
+void print_batch_stats(server_info* servers, uint32_t count)
+{
+    uint64_t in_calls = 0, in_packets = 0, out_calls = 0, out_messages = 0, out_packets = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        in_calls += servers[i].in.calls;
+        in_packets += servers[i].in.packets;
+        out_calls += servers[i].out.calls;
+        out_messages += servers[i].out.messages;
+        out_packets += servers[i].out.packets;
+    }
+
+    fprintf(stdout, "Average receive batch fill: %.2f of %u (%lu calls)\n",
+        in_calls ? (double)in_packets / in_calls : 0.0,
+        servers[0].config->batch_size, (unsigned long)in_calls);
+    fprintf(stdout, "Average send batch fill: %.2f of %u (%lu calls)\n",
+        out_calls ? (double)out_messages / out_calls : 0.0,
+        servers[0].config->batch_size, (unsigned long)out_calls);
+    fprintf(stdout, "Datagrams per send call: %.2f (%s)\n",
+        out_calls ? (double)out_packets / out_calls : 0.0,
+        servers[0].max_segment > 0 ? "with UDP GSO" : "without UDP GSO");
+    fflush(stdout);
+}
+
+/*
+ * Set up an empty file cache holding at most budget bytes of the files
+ * in root. The root is opened once here, every name asked for is 
+ * resolved beneath it. The file index is empty until init_index.
+ */
+void init_cache(file_cache* cache, const char* root, uint64_t budget)
+{
+    if (pthread_mutex_init(&cache->lock, NULL) != 0)
+    {
+        exit_error("Failed to create cache lock!\n");
+    }
+    cache->root = root;
+    cache->root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (ERROR(cache->root_fd))
+    {
+        exit_error("Failed to open root directory!\n");
+    }
+
+    cache->files = g_hash_table_new(g_str_hash, g_str_equal);
+    cache->lru.next = cache->lru.prev = &cache->lru;
+    cache->budget = budget;
+    cache->used = 0;
+    cache->hits = cache->misses = cache->evictions = cache->conversions = cache->unopened = 0;
+
+    file_index* index = &cache->index;
+    init_index_tables(index);
+    index->watch_fd = index->wake = -1;
+    index->ready = false;
+    index->missing = 0;
+}
+
+/*
+ * Free every file in the cache. Only called once all workers have
+ * stopped, so none of them are in use.
+ */
+void destroy_cache(file_cache* cache)
+{
+    while (cache->lru.next != &cache->lru)
+    {
+        cached_file* file = cache->lru.next;
+        drop_file(cache, file);
+        free_file(file);
+    }
+    g_hash_table_destroy(cache->files);
+    g_hash_table_destroy(cache->index.entries);
+    g_hash_table_destroy(cache->index.dirs);
+    pthread_mutex_destroy(&cache->lock);
+    if (cache->index.watch_fd >= 0)
+    {
+        close(cache->index.watch_fd);
+    }
+    close(cache->root_fd);
+}
+
+/*
+ * Report how well the file cache did, for tuning -c.
+ */
+void print_cache_stats(file_cache* cache)
+{
+    fprintf(stdout, "File cache: %lu hits (%lu without opening the file), %lu misses, %lu evictions, "
+        "%lu netascii conversions, %lu bytes held\n",
+        (unsigned long)cache->hits, (unsigned long)cache->unopened, (unsigned long)cache->misses, 
+        (unsigned long)cache->evictions, (unsigned long)cache->conversions, (unsigned long)cache->used);
+    if (cache->index.watch_fd >= 0)
+    {
+        fprintf(stdout, "File index: %lu requests for missing files answered from it\n",
+            (unsigned long)cache->index.missing);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Report how often transfers had to wait for the disk, for tuning -r,
+ * and how often uploads did.
+ */
+void print_read_stats(server_info* servers, uint32_t count)
+{
+    uint64_t ranges = 0, stalls = 0, chunks = 0, held = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ranges += servers[i].ranges_read;
+        stalls += servers[i].read_stalls;
+        chunks += servers[i].chunks_written;
+        held += servers[i].write_stalls;
+    }
+    if (servers[0].config->readers > 0)
+    {
+        fprintf(stdout, "Read ahead: %lu ranges read from disk, transfers waited %lu times\n",
+            (unsigned long)ranges, (unsigned long)stalls);
+    }
+    if (servers[0].config->uploads)
+    {
+        fprintf(stdout, "Uploads: %lu chunks written, ACKs waited %lu times for a write\n",
+            (unsigned long)chunks, (unsigned long)held);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Get the shared copy of the file at path, relative to the root, if the
+ * file index has it as the same file that is cached. Otherwise returns
+ * NULL, with missing set if the index knows there is no such file, 
+ * else the file has to be opened and checked, see acquire_file. Names
+ * written in other ways than the index has them are not looked up, nor
+ * are names beneath a symbolic link or a directory not read yet, the 
+ * kernel resolves those.
+ */
+cached_file* lookup_file(file_cache* cache, const char* path, bool* missing)
+{
+    *missing = false;
+    if (!canonical_name(path))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    file_index* index = &cache->index;
+    index_entry* entry = index->ready ? (index_entry*)g_hash_table_lookup(index->entries, path) : NULL;
+    if (entry == NULL || entry->type != S_IFREG)
+    {
+        // A directory or device is refused as a missing file would be
+        if (index->ready && (entry == NULL ? !below_link(index, path) : entry->type != S_IFLNK))
+        {
+            *missing = true;
+            index->missing++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    cached_file* file = (cached_file*)g_hash_table_lookup(cache->files, path);
+    if (file == NULL || file->device != entry->device || file->inode != entry->inode ||
+        file->modified.tv_sec != entry->modified.tv_sec ||
+        file->modified.tv_nsec != entry->modified.tv_nsec || file->size != entry->size)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    METRIC_ADD(cache->hits, 1);
+    METRIC_ADD(cache->unopened, 1);
+    file->users++;
+    touch_file(cache, file);
+    pthread_mutex_unlock(&cache->lock);
+    return file;
+}
+
+/*
+ * Get the shared copy of the file open as fd, mapping it into the cache
+ * if it is not there or has changed since. Returns NULL if the cache is
+ * disabled or the file does not fit, the caller then reads fd itself.
+ * The lock is only taken here, in lookup_file and in release_file, so 
+ * once per transfer, and by the index thread.
+ */
+cached_file* acquire_file(file_cache* cache, const char* path, int32_t fd, struct stat* file_stat)
+{
+    if (cache->budget == 0 || (uint64_t)file_stat->st_size > cache->budget)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    // A hit only if it is still the same file, unchanged
+    cached_file* file = (cached_file*)g_hash_table_lookup(cache->files, path);
+    if (file != NULL)
+    {
+        if (file->device == file_stat->st_dev && file->inode == file_stat->st_ino &&
+            file->modified.tv_sec == file_stat->st_mtim.tv_sec &&
+            file->modified.tv_nsec == file_stat->st_mtim.tv_nsec &&
+            file->size == (uint64_t)file_stat->st_size)
+        {
+            METRIC_ADD(cache->hits, 1);
+            file->users++;
+            touch_file(cache, file);
+            pthread_mutex_unlock(&cache->lock);
+            return file;
+        }
+
+        // Stale, transfers still reading the old one keep it until done
+        drop_file(cache, file);
+        if (file->users == 0)
+        {
+            free_file(file);
+        }
+    }
+    METRIC_ADD(cache->misses, 1);
+
+    file = map_file(fd, file_stat);
+    if (file == NULL)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    file->cache = cache;
+    file->path = strdup(path);
+    file->cached = true;
+
+    file->next = cache->lru.next;
+    file->prev = &cache->lru;
+    cache->lru.next->prev = file;
+    cache->lru.next = file;
+    g_hash_table_insert(cache->files, file->path, file);
+    METRIC_ADD(cache->used, file->size);
+    evict_files(cache);
+
+    pthread_mutex_unlock(&cache->lock);
+    return file;
+}
+
+/*
+ * Move a cached file to the front of the LRU list. Lock must be held.
+ */
+void touch_file(file_cache* cache, cached_file* file)
+{
+    file->prev->next = file->next;
+    file->next->prev = file->prev;
+    file->next = cache->lru.next;
+    file->prev = &cache->lru;
+    cache->lru.next->prev = file;
+    cache->lru.next = file;
+}
+
+/*
+ * Build the file index, every name beneath the root with what fstatat
+ * says of it, and start the index thread that keeps it current with 
+ * inotify. A name not in the index is then answered as missing without
+ * a syscall. If a directory can not be watched, the kernel's limit on
+ * watches is the usual reason, there is no index and every request 
+ * opens its file.
+ */
+void init_index(file_cache* cache)
+{
+    file_index* index = &cache->index;
+    index->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ERROR(index->watch_fd))
+    {
+        fprintf(stdout, "File index: no inotify, files are opened on every request...\n");
+        fflush(stdout);
+        return;
+    }
+
+    uint64_t started = monotonic_us();
+    index->ready = index_tree(cache, index, "");
+    uint64_t elapsed = monotonic_us() - started;
+    if (!index->ready)
+    {
+        fprintf(stdout, "File index: not every directory could be watched, "
+            "files are opened on every request...\n");
+        fflush(stdout);
+        close(index->watch_fd);
+        index->watch_fd = -1;
+        g_hash_table_remove_all(index->entries);
+        g_hash_table_remove_all(index->dirs);
+        return;
+    }
+
+    // Watched directories are all of them, the root included
+    uint32_t dirs = g_hash_table_size(index->dirs);
+    fprintf(stdout, "File index: %u files in %u director%s, built in %.1f ms...\n",
+        g_hash_table_size(index->entries) - (dirs - 1), dirs, dirs == 1 ? "y" : "ies", elapsed / 1000.0);
+    fflush(stdout);
+
+    index->wake = eventfd(0, EFD_CLOEXEC);
+    if (ERROR(index->wake))
+    {
+        exit_error("Failed to create index event!\n");
+    }
+    if (pthread_create(&index->thread, NULL, run_index, cache) != 0)
+    {
+        exit_error("Failed to start index thread!\n");
+    }
+}
+
+/*
+ * Stop the index thread, if there is one.
+ */
+void stop_index(file_cache* cache)
+{
+    file_index* index = &cache->index;
+    if (index->wake < 0)
+    {
+        return;
+    }
+    uint64_t one = 1;
+    if (ERROR(write(index->wake, &one, sizeof(one))))
+    {
+        exit_error("Failed to stop index thread!\n");
+    }
+    pthread_join(index->thread, NULL);
+    close(index->wake);
+    index->wake = -1;
+}
+
+/*
+ * Index thread. Sleeps until inotify has events or the thread is 
+ * stopped, and applies the events read at once under one lock. A 
+ * change is seen by requests once applied, which is as soon as this 
+ * thread runs after the change was made. Directories that were added,
+ * and the whole tree after inotify lost events, are read without the 
+ * lock, so requests are never held up by reading a directory. While
+ * the tree is read again, requests open the file as if not indexed.
+ */
+void* run_index(void* arg)
+{
+    file_cache* cache = (file_cache*)arg;
+    file_index* index = &cache->index;
+    struct pollfd ready[2] = 
+    {
+        { index->wake, POLLIN, 0 },
+        { index->watch_fd, POLLIN, 0 }
+    };
+    char events[WATCH_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true)
+    {
+        if (ERROR(poll(ready, 2, -1)))
+        {
+            if (errno == EINTR) continue;
+            exit_error("Index poll failed\n");
+        }
+        if (ready[0].revents)
+        {
+            break;
+        }
+
+        ssize_t size;
+        while ((size = read(index->watch_fd, events, sizeof(events))) > 0)
+        {
+            GQueue added = G_QUEUE_INIT;
+            bool overflow = false;
+            pthread_mutex_lock(&cache->lock);
+            for (char* at = events; at < events + size; )
+            {
+                struct inotify_event* event = (struct inotify_event*)at;
+                at += sizeof(struct inotify_event) + event->len;
+                overflow = overflow || (event->mask & IN_Q_OVERFLOW);
+                apply_index_event(cache, event, &added);
+            }
+            // Names the index missed are opened until it is rebuilt
+            index->ready = index->ready && !overflow;
+            pthread_mutex_unlock(&cache->lock);
+
+            if (overflow)
+            {
+                g_queue_clear_full(&added, free);
+                rebuild_index(cache);
+            }
+            else
+            {
+                index_added(cache, &added);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Apply one inotify event to the index. Whatever happened to a name,
+ * it is looked up again, so events that were merged or came in a burst
+ * leave the index as the directory is now. Directories that were added
+ * go in added, to be read once the lock is let go, see index_added. 
+ * Lock must be held.
+ */
+void apply_index_event(file_cache* cache, const struct inotify_event* event, GQueue* added)
+{
+    file_index* index = &cache->index;
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        return;
+    }
+
+    // A watch is gone once its directory is, or once removed by us
+    const char* dir = (const char*)g_hash_table_lookup(index->dirs, GINT_TO_POINTER(event->wd));
+    if (dir == NULL)
+    {
+        return;
+    }
+    if (event->mask & IN_IGNORED)
+    {
+        g_hash_table_remove(index->dirs, GINT_TO_POINTER(event->wd));
+        return;
+    }
+
+    // Events on the directory itself are seen as events in its parent
+    if (event->len == 0)
+    {
+        return;
+    }
+    char name[PATH_MAX];
+    if (snprintf(name, sizeof(name), "%s%s%s", dir, dir[0] != '\0' ? "/" : "", event->name) >= (int32_t)sizeof(name))
+    {
+        return;
+    }
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        unindex_path(index, name);
+    }
+    else
+    {
+        // A name moved or created may be a directory put in place of another
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            unindex_path(index, name);
+        }
+        index_path(cache, name, added);
+    }
+}
+
+/*
+ * Build the index again after inotify lost events. The tree is read
+ * into tables of our own without the lock, and the lock is only taken
+ * to put them in place of the index's. Adding a watch that is there 
+ * already gives the same one, so the watches of directories that are 
+ * not in the tree any more are removed after. Events that came in the
+ * meantime are applied to the new index as usual. Only called by the 
+ * index thread.
+ */
+void rebuild_index(file_cache* cache)
+{
+    file_index* index = &cache->index;
+    file_index scan = *index;
+    init_index_tables(&scan);
+    bool complete = index_tree(cache, &scan, "");
+
+    pthread_mutex_lock(&cache->lock);
+    GHashTable* entries = index->entries;
+    GHashTable* dirs = index->dirs;
+    index->entries = scan.entries;
+    index->dirs = scan.dirs;
+    index->ready = complete;
+    GHashTableIter it;
+    gpointer watch;
+    g_hash_table_iter_init(&it, dirs);
+    while (g_hash_table_iter_next(&it, &watch, NULL))
+    {
+        if (!g_hash_table_contains(index->dirs, watch))
+        {
+            inotify_rm_watch(index->watch_fd, GPOINTER_TO_INT(watch));
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    g_hash_table_destroy(entries);
+    g_hash_table_destroy(dirs);
+    if (logging(WARN_LEVEL))
+    {
+        log_event(WARN_LEVEL, "event=index_rebuilt entries=%u complete=%s",
+            g_hash_table_size(scan.entries), complete ? "yes" : "no");
+    }
+}
+
+/*
+ * Index the directories that were added, and everything beneath them,
+ * into tables of our own without the lock, and merge those into the 
+ * index under it. Each directory is watched before it is read, so what
+ * changes in it meanwhile comes as events after. Only called by the 
+ * index thread.
+ */
+void index_added(file_cache* cache, GQueue* added)
+{
+    if (g_queue_is_empty(added))
+    {
+        return;
+    }
+    file_index* index = &cache->index;
+    file_index scan = *index;
+    init_index_tables(&scan);
+    bool complete = true;
+    char* dir;
+    while ((dir = (char*)g_queue_pop_head(added)) != NULL)
+    {
+        if (!index_tree(cache, &scan, dir))
+        {
+            complete = false;
+            if (logging(WARN_LEVEL))
+            {
+                log_event(WARN_LEVEL, "event=index_incomplete dir=\"%s\"", dir);
+            }
+        }
+        free(dir);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    merge_index(index, &scan);
+    index->ready = index->ready && complete;
+    pthread_mutex_unlock(&cache->lock);
+
+    g_hash_table_destroy(scan.entries);
+    g_hash_table_destroy(scan.dirs);
+}
+
+/*
+ * Create the tables of an index. Entries are freed with their name, it
+ * is their key.
+ */
+void init_index_tables(file_index* index)
+{
+    index->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free);
+    index->dirs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+    if (index->entries == NULL || index->dirs == NULL)
+    {
+        exit_error("Failed to allocate file index!\n");
+    }
+}
+
+/*
+ * Move everything in the tables of scan into the index, in place of 
+ * what it had under the same names and watches. Lock must be held.
+ */
+void merge_index(file_index* index, file_index* scan)
+{
+    GHashTableIter it;
+    gpointer key, value;
+    g_hash_table_iter_init(&it, scan->entries);
+    while (g_hash_table_iter_next(&it, &key, &value))
+    {
+        g_hash_table_iter_steal(&it);
+        g_hash_table_replace(index->entries, key, value);
+    }
+    g_hash_table_iter_init(&it, scan->dirs);
+    while (g_hash_table_iter_next(&it, &key, &value))
+    {
+        g_hash_table_iter_steal(&it);
+        g_hash_table_replace(index->dirs, key, value);
+    }
+}
+
+/*
+ * Index the directory top, relative to the root, and every directory 
+ * beneath it into the tables of index, one at a time rather than 
+ * recursing. Returns false if one could not be watched or read, the 
+ * index is then incomplete. The index thread reads into tables of its
+ * own, the lock is not needed for them.
+ */
+bool index_tree(file_cache* cache, file_index* index, const char* top)
+{
+    GQueue pending = G_QUEUE_INIT;
+    g_queue_push_tail(&pending, strdup(top));
+    bool complete = true;
+    char* dir;
+    while ((dir = (char*)g_queue_pop_head(&pending)) != NULL)
+    {
+        complete = complete && index_directory(cache, index, dir, &pending);
+        free(dir);
+    }
+    return complete;
+}
+
+/*
+ * Watch the directory dir and put its entries in the index, queueing 
+ * its subdirectories in pending. It is watched before it is read, so a
+ * name added meanwhile is either read or seen as an event. One that 
+ * went away meanwhile is not an error, its event removes it.
+ */
+bool index_directory(file_cache* cache, file_index* index, const char* dir, GQueue* pending)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", cache->root, dir) >= (int32_t)sizeof(path))
+    {
+        return false;
+    }
+    int32_t watch = inotify_add_watch(index->watch_fd, path, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (ERROR(watch))
+    {
+        return errno == ENOENT || errno == ENOTDIR;
+    }
+    g_hash_table_replace(index->dirs, GINT_TO_POINTER(watch), strdup(dir));
+
+    int32_t fd = openat(cache->root_fd, dir[0] != '\0' ? dir : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* stream = ERROR(fd) ? NULL : fdopendir(fd);
+    if (stream == NULL)
+    {
+        bool gone = errno == ENOENT || errno == ENOTDIR || errno == ELOOP;
+        if (!ERROR(fd))
+        {
+            close(fd);
+        }
+        return gone;
+    }
+
+    bool complete = true;
+    struct dirent* found;
+    while (complete && (found = readdir(stream)) != NULL)
+    {
+        if (!strcmp(found->d_name, ".") || !strcmp(found->d_name, ".."))
+        {
+            continue;
+        }
+        char name[PATH_MAX];
+        struct stat file_stat;
+        if (snprintf(name, sizeof(name), "%s%s%s", dir, dir[0] != '\0' ? "/" : "", found->d_name) >= (int32_t)sizeof(name))
+        {
+            complete = false;
+        }
+        else if (!ERROR(fstatat(fd, found->d_name, &file_stat, AT_SYMLINK_NOFOLLOW)))
+        {
+            put_entry(index, name, &file_stat);
+            if (S_ISDIR(file_stat.st_mode))
+            {
+                g_queue_push_tail(pending, strdup(name));
+            }
+        }
+    }
+    closedir(stream);
+    return complete;
+}
+
+/*
+ * Look up name again and update its entry. If it became a directory it
+ * goes in added, so what is beneath it is indexed once the lock is let
+ * go, see index_added. A name that is gone is removed. Lock must be 
+ * held.
+ */
+void index_path(file_cache* cache, const char* name, GQueue* added)
+{
+    file_index* index = &cache->index;
+    index_entry* entry = (index_entry*)g_hash_table_lookup(index->entries, name);
+    bool was_dir = entry != NULL && entry->type == S_IFDIR;
+    struct stat file_stat;
+    bool gone = ERROR(fstatat(cache->root_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW));
+    if (gone || (was_dir && !S_ISDIR(file_stat.st_mode)))
+    {
+        unindex_path(index, name);
+        was_dir = false;
+        if (gone)
+        {
+            return;
+        }
+    }
+    entry = put_entry(index, name, &file_stat);
+    if (S_ISDIR(file_stat.st_mode) && !was_dir && added != NULL)
+    {
+        entry->unread = true;
+        g_queue_push_tail(added, strdup(name));
+    }
+}
+
+/*
+ * Remove name from the index, and if it is a directory everything 
+ * beneath it along with the watches. Lock must be held.
+ */
+void unindex_path(file_index* index, const char* name)
+{
+    index_entry* entry = (index_entry*)g_hash_table_lookup(index->entries, name);
+    if (entry == NULL)
+    {
+        return;
+    }
+    if (entry->type == S_IFDIR)
+    {
+        size_t length = strlen(name);
+        GHashTableIter it;
+        gpointer key, value;
+        g_hash_table_iter_init(&it, index->entries);
+        while (g_hash_table_iter_next(&it, &key, &value))
+        {
+            if (is_below((const char*)key, name, length))
+            {
+                g_hash_table_iter_remove(&it);
+            }
+        }
+        g_hash_table_iter_init(&it, index->dirs);
+        while (g_hash_table_iter_next(&it, &key, &value))
+        {
+            if (!strcmp((const char*)value, name) || is_below((const char*)value, name, length))
+            {
+                inotify_rm_watch(index->watch_fd, GPOINTER_TO_INT(key));
+                g_hash_table_iter_remove(&it);
+            }
+        }
+    }
+    g_hash_table_remove(index->entries, name);
+}
+
+/*
+ * Add name to the index or update its entry. Lock must be held.
+ */
+index_entry* put_entry(file_index* index, const char* name, const struct stat* file_stat)
+{
+    index_entry* entry = (index_entry*)g_hash_table_lookup(index->entries, name);
+    if (entry == NULL)
+    {
+        size_t length = strlen(name);
+        entry = (index_entry*)malloc(sizeof(index_entry) + length + 1);
+        if (entry == NULL)
+        {
+            exit_error("Failed to allocate index entry!\n");
+        }
+        memcpy(entry->name, name, length + 1);
+        g_hash_table_insert(index->entries, entry->name, entry);
+    }
+    entry->device = file_stat->st_dev;
+    entry->inode = file_stat->st_ino;
+    entry->modified = file_stat->st_mtim;
+    entry->size = file_stat->st_size;
+    entry->type = file_stat->st_mode & S_IFMT;
+    entry->unread = false;
+    return entry;
+}
+
+/*
+ * Whether name is beneath the directory dir, of the given length.
+ */
+bool is_below(const char* name, const char* dir, size_t length)
+{
+    return !strncmp(name, dir, length) && name[length] == '/';
+}
+
+/*
+ * Whether name is written as the index has names, with no empty, "." 
+ * or ".." components.
+ */
+bool canonical_name(const char* name)
+{
+    const char* component = name;
+    while (true)
+    {
+        size_t length = strcspn(component, "/");
+        if (length == 0 || (length == 1 && component[0] == '.') || 
+            (length == 2 && component[0] == '.' && component[1] == '.'))
+        {
+            return false;
+        }
+        if (component[length] == '\0')
+        {
+            return true;
+        }
+        component += length + 1;
+    }
+}
+
+/*
+ * Whether a directory on the path to name, which is not in the index,
+ * is a symbolic link, or was added and is not read yet. The index does
+ * not know what is beneath those. Lock must be held.
+ */
+bool below_link(file_index* index, const char* name)
+{
+    char dir[PATH_MAX];
+    for (const char* slash = strchr(name, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        size_t length = slash - name;
+        if (length >= sizeof(dir))
+        {
+            return true;
+        }
+        memcpy(dir, name, length);
+        dir[length] = '\0';
+        index_entry* entry = (index_entry*)g_hash_table_lookup(index->entries, dir);
+        if (entry == NULL || entry->type != S_IFDIR || entry->unread)
+        {
+            return entry != NULL && (entry->type == S_IFLNK || entry->unread);
+        }
+    }
+    return false;
+}
+
+/*
+ * Map the file open as fd for a single transfer, outside of the cache.
+ * Returns NULL if it could not be mapped.
+ */
+cached_file* map_file(int32_t fd, struct stat* file_stat)
+{
+    cached_file* file = (cached_file*)malloc(sizeof(cached_file));
+    if (file == NULL)
+    {
+        exit_error("Failed to allocate mapped file!\n");
+    }
+
+    file->data = NULL;
+    file->netascii = NULL;
+    file->netascii_size = 0;
+    file->size = file_stat->st_size;
+    if (file->size > 0)
+    {
+        file->data = (char*)mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->data == MAP_FAILED)
+        {
+            free(file);
+            return NULL;
+        }
+
+        // Transfers read it front to back. The mapping keeps this open
+        // file, so page faults in it read ahead twice as far.
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    file->cache = NULL;
+    file->path = NULL;
+    file->device = file_stat->st_dev;
+    file->inode = file_stat->st_ino;
+    file->modified = file_stat->st_mtim;
+    file->users = 1;
+    file->converting = false;
+    file->cached = false;
+    file->next = file->prev = NULL;
+    return file;
+}
+
+/*
+ * Make sure a cached file has its netascii form, converting it if no
+ * client has asked for it before. The conversion is done outside the
+ * lock, if two workers race the first one's is kept. It is converted
+ * from a copy read from fd, or from the file opened again if fd is -1,
+ * see read_copy. Returns false if the file is not cached, has changed
+ * or its netascii form would not fit.
+ */
+bool prepare_netascii(cached_file* file, int32_t fd)
+{
+    file_cache* cache = file->cache;
+    if (cache == NULL)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    bool ready = file->netascii != NULL;
+    pthread_mutex_unlock(&cache->lock);
+    if (ready)
+    {
+        return true;
+    }
+
+    char* copy = (char*)malloc(file->size ? file->size : 1);
+    if (copy == NULL)
+    {
+        return false;
+    }
+    if (!read_copy(file, fd, copy))
+    {
+        free(copy);
+        return false;
+    }
+    uint64_t size = netascii_size(copy, file->size);
+    char* netascii = file->size + size > cache->budget ? NULL : (char*)malloc(size ? size : 1);
+    if (netascii == NULL)
+    {
+        free(copy);
+        return false;
+    }
+    size_t consumed;
+    char carry = -1;
+    netascii_convert(copy, file->size, &consumed, netascii, size, &carry);
+    free(copy);
+
+    pthread_mutex_lock(&cache->lock);
+    if (file->netascii == NULL)
+    {
+        file->netascii = netascii;
+        file->netascii_size = size;
+        METRIC_ADD(cache->conversions, 1);
+        if (file->cached)
+        {
+            METRIC_ADD(cache->used, size);
+            evict_files(cache);
+        }
+        netascii = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    free(netascii);
+    return true;
+}
+
+/*
+ * Read all of a cached file into copy with pread, from fd or from the
+ * file opened again by its path if fd is -1. The mapping is not read,
+ * since a file cut short in place would fault with SIGBUS there. 
+ * Returns false if the file is no longer the one cached, in size too,
+ * or could not be read to its end.
+ */
+bool read_copy(cached_file* file, int32_t fd, char* copy)
+{
+    int32_t own_fd = fd < 0 ? open_beneath(file->cache->root_fd, file->path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0 && ERROR(own_fd))
+    {
+        return false;
+    }
+    fd = fd < 0 ? own_fd : fd;
+
+    struct stat file_stat;
+    bool same = !ERROR(fstat(fd, &file_stat)) && 
+        file->device == file_stat.st_dev && file->inode == file_stat.st_ino &&
+        file->modified.tv_sec == file_stat.st_mtim.tv_sec &&
+        file->modified.tv_nsec == file_stat.st_mtim.tv_nsec &&
+        file->size == (uint64_t)file_stat.st_size;
+
+    uint64_t offset = 0;
+    while (same && offset < file->size)
+    {
+        ssize_t got = pread(fd, copy + offset, file->size - offset, offset);
+        if (got <= 0)
+        {
+            if (ERROR(got) && errno == EINTR)
+            {
+                continue;
+            }
+            same = false;
+            break;
+        }
+        offset += got;
+    }
+
+    if (own_fd >= 0)
+    {
+        close(own_fd);
+    }
+    return same;
+}
+
+/*
+ * Have a reader thread convert a cached file to netascii, unless it is
+ * converted or being converted already, see convert_file. The job holds
+ * the file until it is done. Returns true if the netascii form is ready.
+ */
+bool queue_conversion(server_info* server, cached_file* file)
+{
+    file_cache* cache = file->cache;
+    if (cache == NULL)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    bool ready = file->netascii != NULL;
+    bool start = !ready && !file->converting && file->cached;
+    if (start)
+    {
+        file->converting = true;
+        file->users++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (!start)
+    {
+        return ready;
+    }
+
+    read_job* job = (read_job*)malloc(sizeof(read_job));
+    if (job == NULL)
+    {
+        pthread_mutex_lock(&cache->lock);
+        file->converting = false;
+        pthread_mutex_unlock(&cache->lock);
+        release_file(file);
+        return false;
+    }
+    job->next = NULL;
+    job->server = server;
+    job->client = NULL;
+    job->kind = CONVERT_IO;
+    job->file = file;
+    queue_job(server->readers, job);
+    return false;
+}
+
+/*
+ * Convert a file queued by queue_conversion, on a reader thread. The file
+ * is opened again to read it, so the transfer's fd may close meanwhile.
+ * If it could not be converted, the next request for it tries again.
+ */
+void convert_file(cached_file* file)
+{
+    prepare_netascii(file, -1);
+    pthread_mutex_lock(&file->cache->lock);
+    file->converting = false;
+    pthread_mutex_unlock(&file->cache->lock);
+    release_file(file);
+}
+
+/*
+ * A transfer is done with a mapped file, from the cache or its own.
+ */
+void release_file(cached_file* file)
+{
+    file_cache* cache = file->cache;
+    if (cache == NULL)
+    {
+        free_file(file);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    file->users--;
+    if (file->users == 0)
+    {
+        if (file->cached)
+        {
+            // It may have been kept over the budget while in use
+            evict_files(cache);
+        }
+        else
+        {
+            free_file(file);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Take a file out of the cache. It is freed by the caller, or by the 
+ * last transfer reading it. Lock must be held.
+ */
+void drop_file(file_cache* cache, cached_file* file)
+{
+    g_hash_table_remove(cache->files, file->path);
+    file->prev->next = file->next;
+    file->next->prev = file->prev;
+    file->next = file->prev = NULL;
+    file->cached = false;
+    METRIC_ADD(cache->used, -(file->size + file->netascii_size));
+}
+
+/*
+ * Free the least recently used files nobody is reading until the cache
+ * is within its budget. Files in use are skipped, so the cache may be
+ * over budget until they are released. Lock must be held.
+ */
+void evict_files(file_cache* cache)
+{
+    cached_file* file = cache->lru.prev;
+    while (cache->used > cache->budget && file != &cache->lru)
+    {
+        cached_file* newer = file->prev;
+        if (file->users == 0)
+        {
+            drop_file(cache, file);
+            free_file(file);
+            METRIC_ADD(cache->evictions, 1);
+        }
+        file = newer;
+    }
+}
+
+/*
+ * Unmap and free a file that is no longer in the cache.
+ */
+void free_file(cached_file* file)
+{
+    if (file->data != NULL)
+    {
+        munmap(file->data, file->size);
+    }
+    free(file->netascii);
+    free(file->path);
+    free(file);
+}
+
+/*
+ * Create the epoll instance and register the listening socket
+ * and the periodic inactivity timer with it.
+ */
+void init_event_loop(server_info* server)
+{
+    server->epoll_fd = epoll_create1(0);
+    if (ERROR(server->epoll_fd))
+    {
+        exit_error("Failed to create epoll instance!\n");
+    }
+
+    // Timer is armed for the earliest deadline in the timer wheel
+    server->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (ERROR(server->timer.fd))
+    {
+        exit_error("Failed to create timer!\n");
+    }
+    server->now_us = monotonic_us();
+    server->now = server->now_us / 1000;
+    init_wheel(&server->wheel, server->timer.fd, server->now);
+
+    server->listener.type = LISTENER_EVENT;
+    server->listener.fd = server->fd;
+    server->timer.type = TIMER_EVENT;
+    server->shutdown.type = SHUTDOWN_EVENT;
+    server->shutdown.fd = shutdown_fd;
+
+    watch_event_source(server, &server->listener, EPOLLIN | EPOLLET);
+    watch_event_source(server, &server->timer, EPOLLIN | EPOLLET);
+    watch_event_source(server, &server->shutdown, EPOLLIN);
+}
+
+/*
+ * Add an event source to the epoll instance. The source itself is 
+ * handed back to us as the event's data pointer.
+ */
+void watch_event_source(server_info* server, event_source* source, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    if (ERROR(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, source->fd, &ev)))
+    {
+        exit_error("Failed to watch file descriptor!\n");
+    }
+}
+
+/*
+ * Convert port as string to an unsigned short.
+ */
+uint16_t convert_port(const char* port_string)
+{
+    int32_t port = strtoul(port_string, NULL, 0);
+    if (errno == ERANGE || port == 0 || port > 65535)
+    {
+        exit_error("Invalid port!\n");
+    }
+    return (uint16_t)port;
+}
+
+/*
+ * Client's deadline has passed, we go back and resend the window and
+ * back off its timeout. If it has run out of resends, it is removed 
+ * from the pool.
+ */
+void expire_client(client_table* clients, server_info* server, client_value* client)
+{
+    if (client->upload != NULL)
+    {
+        expire_upload(clients, server, client);
+        return;
+    }
+
+    METRIC_ADD(server->metrics.timeouts, 1);
+    reply_to_client(server, client);
+    if (client->resends++ == server->config->max_resends)
+    {
+        // Send error to timed out client
+        send_error(server, UNDEFINED);
+        remove_client(clients, server, client, TIMEOUT_RESULT);
+        return;
+    }
+
+    if (logging(DEBUG_LEVEL))
+    {
+        char address[ADDRESS_SIZE];
+        format_address(&client->address, address);
+        log_event(DEBUG_LEVEL, "event=resend client=%s block=%" PRIu64 " reason=timeout timeout_ms=%" PRIu64, 
+            address, client->base, client->timeout);
+    }
+    back_off(server->config, client);
+    client->rewound_base = client->base;
+    client->next = client->base;
+    send_window(server, client);
+}
+
+/*
+ * Microseconds on the monotonic clock.
+ */
+uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Timer wheel with WHEEL_LEVELS levels of WHEEL_SLOTS slots. Level 0 has
+ * a slot per millisecond, each level above has a slot per full turn of 
+ * the one below. A timer goes in the lowest level whose range reaches 
+ * its expiry and moves down a level each time its slot comes up, so 
+ * scheduling and cancelling are O(1) and only due timers are touched.
+ */
+void init_wheel(timer_wheel* wheel, int32_t fd, uint64_t now)
+{
+    for (uint32_t level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (uint32_t slot = 0; slot < WHEEL_SLOTS; slot++)
+        {
+            timer_entry* head = &wheel->slots[level][slot];
+            head->next = head->prev = head;
+        }
+        wheel->occupied[level] = 0;
+    }
+    wheel->current = now;
+    wheel->armed = UINT64_MAX;
+    wheel->fd = fd;
+}
+
+/*
+ * Schedule (or reschedule) a timer. The timer fd is only touched if 
+ * this is now the earliest timer.
+ */
+void schedule_timer(timer_wheel* wheel, timer_entry* entry, uint64_t expires)
+{
+    cancel_timer(entry);
+    entry->expires = expires;
+    if (expires <= wheel->current)
+    {
+        expires = wheel->current + 1;
+    }
+    place_timer(wheel, entry, expires);
+
+    if (expires < wheel->armed)
+    {
+        arm_wheel(wheel, expires);
+    }
+}
+
+/*
+ * Take a timer out of its slot, if it is in one. The slot's occupied 
+ * bit is left as is and cleared when the slot is next looked at.
+ */
+void cancel_timer(timer_entry* entry)
+{
+    if (entry->next != NULL)
+    {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        entry->next = entry->prev = NULL;
+    }
+}
+
+/*
+ * Put a timer in the slot for time when, which is after the current 
+ * millisecond or, while cascading, at it.
+ */
+void place_timer(timer_wheel* wheel, timer_entry* entry, uint64_t when)
+{
+    uint64_t delta = when - wheel->current;
+    uint32_t level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)))
+    {
+        level++;
+    }
+
+    // Too far out for the top level, it is placed again when that slot comes up
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS))
+    {
+        when = wheel->current + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+
+    uint32_t slot = (when >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer_entry* head = &wheel->slots[level][slot];
+    entry->next = head;
+    entry->prev = head->prev;
+    head->prev->next = entry;
+    head->prev = entry;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/*
+ * Move the wheel forward to now. Timers that are due are appended to
+ * the expired list.
+ */
+void advance_wheel(timer_wheel* wheel, uint64_t now, timer_entry* expired)
+{
+    while (wheel->current < now)
+    {
+        // Skip milliseconds in which nothing can happen, up to the next 
+        // turn of the lowest level that has timers.
+        uint32_t level = 0;
+        while (level < WHEEL_LEVELS && !wheel->occupied[level])
+        {
+            level++;
+        }
+        if (level == WHEEL_LEVELS)
+        {
+            wheel->current = now;
+            break;
+        }
+        if (level > 0)
+        {
+            uint64_t skip_to = wheel->current | ((1ULL << (WHEEL_BITS * level)) - 1);
+            if (skip_to >= now)
+            {
+                wheel->current = now;
+                break;
+            }
+            wheel->current = skip_to;
+        }
+
+        uint64_t tick = ++wheel->current;
+
+        // At each turn of a level, the next slot of the level above moves down
+        for (uint32_t l = 1; l < WHEEL_LEVELS; l++)
+        {
+            if (tick & ((1ULL << (WHEEL_BITS * l)) - 1))
+            {
+                break;
+            }
+            cascade_slot(wheel, l, (tick >> (WHEEL_BITS * l)) & WHEEL_MASK);
+        }
+
+        // Everything in this millisecond's slot is due
+        uint32_t slot = tick & WHEEL_MASK;
+        timer_entry* head = &wheel->slots[0][slot];
+        if (head->next != head)
+        {
+            head->next->prev = expired->prev;
+            expired->prev->next = head->next;
+            head->prev->next = expired;
+            expired->prev = head->prev;
+            head->next = head->prev = head;
+        }
+        wheel->occupied[0] &= ~(1ULL << slot);
+    }
+}
+
+/*
+ * Empty a slot of a higher level into the levels below it.
+ */
+void cascade_slot(timer_wheel* wheel, uint32_t level, uint32_t slot)
+{
+    timer_entry* head = &wheel->slots[level][slot];
+    timer_entry list = *head;
+    head->next = head->prev = head;
+    wheel->occupied[level] &= ~(1ULL << slot);
+
+    if (list.next == head)
+    {
+        return;
+    }
+
+    list.next->prev = &list;
+    list.prev->next = &list;
+    while (list.next != &list)
+    {
+        timer_entry* entry = list.next;
+        cancel_timer(entry);
+        place_timer(wheel, entry, entry->expires > wheel->current ? entry->expires : wheel->current);
+    }
+}
+
+/*
+ * Earliest time at which the wheel has something to do, either a timer 
+ * in level 0 expiring or a slot of a higher level moving down.
+ */
+uint64_t next_wheel_expiry(timer_wheel* wheel)
+{
+    uint64_t next = UINT64_MAX;
+    for (uint32_t level = 0; level < WHEEL_LEVELS; level++)
+    {
+        uint32_t shift = WHEEL_BITS * level;
+        uint64_t index = wheel->current >> shift;
+        while (wheel->occupied[level])
+        {
+            // Rotate so the slot after the current one is bit 0
+            uint32_t start = (index + 1) & WHEEL_MASK;
+            uint64_t bits = wheel->occupied[level];
+            uint64_t rotated = start ? (bits >> start) | (bits << (WHEEL_SLOTS - start)) : bits;
+            uint64_t ahead = __builtin_ctzll(rotated) + 1;
+            uint32_t slot = (index + ahead) & WHEEL_MASK;
+
+            // Bits of slots whose timers were cancelled are cleared lazily
+            timer_entry* head = &wheel->slots[level][slot];
+            if (head->next == head)
+            {
+                wheel->occupied[level] &= ~(1ULL << slot);
+                continue;
+            }
+
+            uint64_t when = (index + ahead) << shift;
+            if (when < next)
+            {
+                next = when;
+            }
+            break;
+        }
+    }
+    return next;
+}
+
+/*
+ * Set the timer fd to fire at when, or disarm it for UINT64_MAX.
+ */
+void arm_wheel(timer_wheel* wheel, uint64_t when)
+{
+    struct itimerspec expiry;
+    memset(&expiry, 0, sizeof(expiry));
+    if (when != UINT64_MAX)
+    {
+        expiry.it_value.tv_sec = when / 1000;
+        expiry.it_value.tv_nsec = (when % 1000) * 1000000L;
+    }
+
+    if (ERROR(timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &expiry, NULL)))
+    {
+        exit_error("Failed to arm timer!\n");
+    }
+    wheel->armed = when;
+}
+
+/*
+ * Set up an empty client table for up to capacity clients. It has at 
+ * least twice as many slots, so it is never more than half full and
+ * never has to grow.
+ */
+void init_table(client_table* table, uint32_t capacity)
+{
+    uint32_t size = 16;
+    while (size < 2 * (uint64_t)capacity)
+    {
+        size *= 2;
+    }
+
+    table->slots = (table_slot*)calloc(size, sizeof(table_slot));
+    if (table->slots == NULL)
+    {
+        exit_error("Failed to allocate client table!\n");
+    }
+    table->mask = size - 1;
+    table->count = 0;
+}
+
+/*
+ * Free the client table. The clients themselves belong to the slab.
+ */
+void destroy_table(client_table* table)
+{
+    free(table->slots);
+}
+
+/*
+ * Hashing for clients. Address and port are mixed together so clients
+ * on the same subnet or with consecutive ports spread over the table.
+ */
+uint32_t hash_address(const sockaddr_in* address)
+{
+    uint64_t key = ((uint64_t)address->sin_addr.s_addr << 16) | address->sin_port;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+/*
+ * Find the slot of the client with this address or, if there is none,
+ * the empty slot where it would go. Either way a single probe sequence,
+ * the empty slot can be handed to insert_client as it is.
+ */
+table_slot* find_client_slot(client_table* table, const sockaddr_in* address)
+{
+    uint32_t i = hash_address(address) & table->mask;
+    while (true)
+    {
+        table_slot* slot = &table->slots[i];
+        if (slot->client == NULL || 
+            (slot->address == address->sin_addr.s_addr && slot->port == address->sin_port))
+        {
+            return slot;
+        }
+        i = (i + 1) & table->mask;
+    }
+}
+
+/*
+ * The client with this address, NULL if there is none.
+ */
+client_value* lookup_client(client_table* table, const sockaddr_in* address)
+{
+    return find_client_slot(table, address)->client;
+}
+
+/*
+ * Put a client in the empty slot find_client_slot returned for its
+ * address. The table must not have changed since.
+ */
+void insert_client(client_table* table, table_slot* slot, client_value* client)
+{
+    slot->address = client->address.sin_addr.s_addr;
+    slot->port = client->address.sin_port;
+    slot->client = client;
+    table->count++;
+}
+
+/*
+ * Empty a slot. The clients after it in the same probe sequence are
+ * moved back into the hole, so no tombstones are needed.
+ */
+void remove_client_slot(client_table* table, table_slot* slot)
+{
+    if (slot->client == NULL)
+    {
+        return;
+    }
+    table->count--;
+
+    uint32_t hole = slot - table->slots;
+    uint32_t i = hole;
+    while (true)
+    {
+        i = (i + 1) & table->mask;
+        table_slot* next = &table->slots[i];
+        if (next->client == NULL)
+        {
+            break;
+        }
+
+        // It may fill the hole if its home slot is not between the hole
+        // and where it is now, going around the end of the table
+        uint32_t home = hash_address(&next->client->address) & table->mask;
+        if (((i - home) & table->mask) >= ((i - hole) & table->mask))
+        {
+            table->slots[hole] = *next;
+            hole = i;
+        }
+    }
+    table->slots[hole].client = NULL;
+}
+
+/*
+ * Free the client's resources, closing its socket and releasing its
+ * file, and return it to the slab.
+ */
+void free_client(client_slab* slab, client_value* cv) 
+{
+    cancel_timer(&cv->timer);
+    if (cv->event.fd >= 0)
+    {
+        close(cv->event.fd);
+    }
+    if (cv->file != NULL)
+    {
+        release_file(cv->file);
+    }
+    if (cv->fd >= 0)
+    {
+        close(cv->fd);
+    }
+    if (cv->upload != NULL)
+    {
+        discard_upload(cv->upload);
+    }
+
+    // Only buffers and windows larger than the default were allocated
+    size_t index = cv - slab->clients;
+    if (cv->buffer != slab->buffers + index * SLAB_BUFFER)
+    {
+        free(cv->buffer);
+    }
+    if (cv->window != &slab->slots[index])
+    {
+        free(cv->window);
+    }
+
+    cv->link = slab->free;
+    slab->free = cv;
+    METRIC_ADD(slab->used, -1);
+}
+
+/*
+ * Read a batch of packets from socket. Returns how many were read,
+ * 0 once the socket is drained and the read would block.
+ */
+uint32_t socket_listener(server_info* server, int32_t fd)
+{
+    for (uint32_t i = 0; i < server->config->batch_size; i++)
+    {
+        server->in.msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+
+    int32_t n = recvmmsg(fd, server->in.msgs, server->config->batch_size, MSG_DONTWAIT, NULL);
+    if (ERROR(n))
+    {
+        // A connected socket reports ICMP errors for earlier sends, the
+        // client is gone and our timer will time the transfer out
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED)
+        {
+            return 0;
+        }
+        exit_error("Failure in receiving a message!\n");
+    }
+
+    for (int32_t i = 0; i < n; i++)
+    {
+        server->inputs[i * INPUT_SIZE + server->in.msgs[i].msg_len] = 0;
+    }
+
+    // Requests are timed from when they were received, not from the wakeup
+    server->now_us = monotonic_us();
+    server->now = server->now_us / 1000;
+    server->in.calls++;
+    server->in.messages += n;
+    server->in.packets += n;
+    return (uint32_t)n;
+}
+
+/*
+ * Open a socket of the transfer's own, a new TID as RFC 1350 has it,
+ * connected to the client and watched by the event loop. Returns false
+ * if none could be had, the transfer then goes through the server's.
+ */
+bool open_transfer_socket(server_info* server, client_value* client)
+{
+    int32_t fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (ERROR(fd))
+    {
+        return false;
+    }
+
+    // Any free port on the interfaces the server listens on
+    sockaddr_in local;
+    memcpy(&local, &server->address, sizeof(sockaddr_in));
+    local.sin_port = 0;
+    if (ERROR(bind(fd, (sockaddr*)&local, (socklen_t)sizeof(sockaddr_in))) ||
+        ERROR(connect(fd, (sockaddr*)&client->address, (socklen_t)sizeof(sockaddr_in))))
+    {
+        close(fd);
+        return false;
+    }
+
+    client->event.fd = fd;
+    enable_zero_copy(server, fd);
+    watch_event_source(server, &client->event, EPOLLIN | EPOLLET);
+    return true;
+}
+
+/*
+ * Send replies to client, from its own socket if it has one.
+ */
+void reply_to_client(server_info* server, client_value* client)
+{
+    if (client->event.fd >= 0)
+    {
+        server->reply_fd = client->event.fd;
+        server->received_from = NULL;
+    }
+    else
+    {
+        server->reply_fd = server->fd;
+        server->received_from = &client->address;
+    }
+    server->peer = &client->address;
+}
+
+/*
+ * Add a packet to the send batch. The buffer is not copied so it must
+ * stay untouched until the batch is flushed, the address is copied.
+ * No address is given for connected sockets.
+ */
+void queue_packet(server_info* server, int32_t fd, void* buffer, size_t size, sockaddr_in* to)
+{
+    if (server->out.count == server->config->batch_size)
+    {
+        flush_packets(server);
+    }
+
+    uint32_t i = server->out.count++;
+    server->out.iovs[2 * i].iov_base = buffer;
+    server->out.iovs[2 * i].iov_len = size;
+    server->out.iovs[2 * i + 1].iov_len = 0;
+    server->out.msgs[i].msg_hdr.msg_iovlen = 1;
+    server->out.fds[i] = fd;
+    server->out.zero_copy[i] = false;
+    if (to != NULL)
+    {
+        memcpy(&server->out.addresses[i], to, sizeof(sockaddr_in));
+        server->out.msgs[i].msg_hdr.msg_name = &server->out.addresses[i];
+        server->out.msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+    else
+    {
+        // Kept only to know whose packet failed, see flush_packets
+        memcpy(&server->out.addresses[i], server->peer, sizeof(sockaddr_in));
+        server->out.msgs[i].msg_hdr.msg_name = NULL;
+        server->out.msgs[i].msg_hdr.msg_namelen = 0;
+    }
+}
+
+/*
+ * Add a block to the send batch. A block sent from the mapped file goes
+ * out as its header followed by the payload straight from the mapping.
+ * Neither changes once sent, so a large one may go out without the 
+ * kernel copying it.
+ */
+void queue_block(server_info* server, int32_t fd, block_slot* slot, sockaddr_in* to)
+{
+    queue_packet(server, fd, slot->data, slot->size, to);
+    if (slot->payload_size > 0)
+    {
+        uint32_t i = server->out.count - 1;
+        server->out.iovs[2 * i + 1].iov_base = (void*)slot->payload;
+        server->out.iovs[2 * i + 1].iov_len = slot->payload_size;
+        server->out.msgs[i].msg_hdr.msg_iovlen = 2;
+        server->out.zero_copy[i] = server->zero_copy_sends && 
+            slot->payload_size >= ZERO_COPY_MIN && slot->payload_size <= ZERO_COPY_MAX;
+    }
+}
+
+/*
+ * Send everything in the send batch, one call per run of packets for
+ * the same socket and with or without MSG_ZEROCOPY. Packets in a run
+ * are joined into as few messages as UDP GSO allows. If a socket's send
+ * buffer is full we drop the rest of its run, the client or our timer 
+ * will ask again. A message the kernel can not read is skipped alone,
+ * and its client ended by drop_faulted.
+ */
+void flush_packets(server_info* server)
+{
+    packet_batch* out = &server->out;
+    uint32_t sent = 0;
+    while (sent < out->count)
+    {
+        int32_t fd = out->fds[sent];
+        bool zero_copy = out->zero_copy[sent];
+        uint32_t end = sent + 1;
+        while (end < out->count && out->fds[end] == fd && out->zero_copy[end] == zero_copy)
+        {
+            end++;
+        }
+
+        uint32_t count = join_packets(server, sent, end, 0);
+        uint32_t done = 0;
+        while (done < count)
+        {
+            int32_t n = sendmmsg(fd, out->joined + done, count - done, zero_copy ? MSG_ZEROCOPY : 0);
+            if (ERROR(n))
+            {
+                if (errno == EINTR) continue;
+                // Too many pages to send without copying after all
+                if (errno == EMSGSIZE && zero_copy)
+                {
+                    zero_copy = false;
+                    continue;
+                }
+                // The kernel would not split the message. EIO if the device
+                // can not, otherwise the datagrams were too large for the
+                // route, so join only smaller ones from now on. The rest of 
+                // the run is joined again.
+                if ((errno == EIO || errno == EINVAL || errno == EMSGSIZE) && out->segments[done] > 1)
+                {
+                    size_t size = packet_size(out, sent);
+                    server->max_segment = errno == EIO ? 0 : (uint32_t)size - 1;
+                    count = join_packets(server, sent, end, done);
+                    continue;
+                }
+                // EFAULT if a mapped file was truncated under us, only that
+                // client's message is skipped
+                if (errno == EFAULT)
+                {
+                    if (server->faulted_count < server->config->batch_size)
+                    {
+                        memcpy(&server->faulted[server->faulted_count++], &out->addresses[sent], sizeof(sockaddr_in));
+                    }
+                    sent += out->segments[done++];
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || 
+                    errno == ECONNREFUSED) break;
+                exit_error("Send failed\n");
+            }
+            out->calls++;
+            out->messages += n;
+            for (int32_t i = 0; i < n; i++)
+            {
+                out->packets += out->segments[done];
+                sent += out->segments[done++];
+            }
+        }
+        sent = end;
+    }
+    out->count = 0;
+    server->flushes++;
+
+    // Nothing sent points into them any more
+    for (uint32_t i = 0; i < server->held_count; i++)
+    {
+        release_file(server->held[i]);
+    }
+    server->held_count = 0;
+}
+
+/*
+ * Describe packets first up to end of the send batch, all for the same
+ * socket, as messages from index at of the joined messages. With UDP GSO
+ * a run of packets for one address where all but the last have the same
+ * size becomes one message, which the kernel splits into datagrams of
+ * that size, so a window of blocks is one trip through the stack. Every
+ * packet has two iovecs, the second possibly empty, so those of a run
+ * follow one another. Returns the index after the last message.
+ */
+uint32_t join_packets(server_info* server, uint32_t first, uint32_t end, uint32_t at)
+{
+    packet_batch* out = &server->out;
+    uint32_t i = first;
+    while (i < end)
+    {
+        struct msghdr* packet = &out->msgs[i].msg_hdr;
+        size_t size = packet_size(out, i);
+        size_t total = size;
+        uint32_t j = i + 1;
+        while (size <= server->max_segment && j < end && j - i < GSO_MAX_SEGMENTS && 
+            packet_size(out, j - 1) == size && packet_size(out, j) <= size &&
+            total + packet_size(out, j) <= GSO_MAX_BYTES &&
+            (packet->msg_name == NULL || 
+                (out->addresses[i].sin_addr.s_addr == out->addresses[j].sin_addr.s_addr &&
+                 out->addresses[i].sin_port == out->addresses[j].sin_port)))
+        {
+            total += packet_size(out, j++);
+        }
+
+        struct msghdr* msg = &out->joined[at].msg_hdr;
+        msg->msg_name = packet->msg_name;
+        msg->msg_namelen = packet->msg_namelen;
+        msg->msg_iov = packet->msg_iov;
+        msg->msg_iovlen = j - i == 1 ? packet->msg_iovlen : 2 * (j - i);
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+        msg->msg_flags = 0;
+        if (j - i > 1)
+        {
+            uint16_t segment = (uint16_t)size;
+            msg->msg_control = out->controls + at * SEGMENT_CONTROL;
+            msg->msg_controllen = SEGMENT_CONTROL;
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+            memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+        out->segments[at++] = j - i;
+        i = j;
+    }
+    return at;
+}
+
+/*
+ * Bytes in packet i of the batch.
+ */
+size_t packet_size(packet_batch* batch, uint32_t i)
+{
+    return batch->iovs[2 * i].iov_len + batch->iovs[2 * i + 1].iov_len;
+}
+
+/*
+ * Let large blocks be sent from a socket without being copied, if the
+ * kernel can and zero copy has not been turned off for the worker.
+ */
+void enable_zero_copy(server_info* server, int32_t fd)
+{
+    int32_t on = 1;
+    if (server->zero_copy_sends && ERROR(setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on))))
+    {
+        server->zero_copy_sends = false;
+    }
+}
+
+/*
+ * Read the notices of zero copy sends that are done off the socket's
+ * error queue. Nothing waits for them, since headers and files are not
+ * changed once sent, but the queue must not fill up. Returns false if
+ * the kernel copied the data anyway, as it does over loopback. Zero 
+ * copy then only costs more.
+ */
+bool read_completions(int32_t fd)
+{
+    bool zero_copied = true;
+    char control[128];
+    while (true)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (ERROR(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)))
+        {
+            break;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR &&
+                err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED))
+            {
+                zero_copied = false;
+            }
+        }
+    }
+    return zero_copied;
+}
+
+/*
+ * Send error package to whoever sent the packet at hand, see reply_fd
+ * and received_from in server. Uses predefined error packages with 
+ * predefined error messages.
+ */
+void send_error(server_info* server, error_code err)
+{
+    METRIC_ADD(server->metrics.errors[err], 1);
+    if (logging(WARN_LEVEL))
+    {
+        char address[ADDRESS_SIZE];
+        format_address(server->peer, address);
+        log_event(WARN_LEVEL, "event=error client=%s code=%d message=\"%s\"", 
+            address, (int32_t)err, error_packs[err].message);
+    }
+
+    queue_packet(server, server->reply_fd, (void*)&error_packs[err], error_packs[err].size, server->received_from);
+}
+
+/*
+ * Handling of RRQ requests. If valid, client is added to pool.
+ */
+void start_new_transfer(client_table* clients, server_info* server)
+{
+    // If a client resends a read request in a middle of a transfer. If
+    // not, pool_slot is where the new client goes.
+    table_slot* pool_slot = find_client_slot(clients, server->received_from);
+    client_value* client = pool_slot->client;
+    if (client != NULL)
+    {
+        //fprintf(stdout, "DEBUG: Double RRQ from client\n"); fflush(stdout);
+
+        // If client is not on first data package, we terminate his transfer since
+        // he should not be sending RRQ at this point. If at first package (or the
+        // OACK, block 0), we allow resends of first package. Nor while uploading.
+        if (client->base > 1 || client->upload != NULL)
+        {
+            //fprintf(stdout, "DEBUG: RRQ in mid transfer\n"); fflush(stdout);
+
+            send_error(server, ILLEGAL_OP);
+            remove_client(clients, server, client, ERROR_RESULT);
+        }
+        else
+        {
+            // On too many resends, we stop resending and send one error before
+            // terminating. Otherwise we resend the first package.
+            if (client->resends++ == server->config->max_resends)
+            {
+                //fprintf(stdout, "DEBUG: Removing after constant RRQ\n"); fflush(stdout);
+
+                send_error(server, UNDEFINED);
+                remove_client(clients, server, client, ERROR_RESULT);
+            }
+            else
+            {
+                //fprintf(stdout, "DEBUG: Resending after double RRQ\n"); fflush(stdout);
+
+                client->next = client->base;
+                send_window(server, client);
+            }
+        }
+        return;
+    }
+
+    METRIC_ADD(server->metrics.requests, 1);
+
+    // The file name is relative to the root, a leading '/' is ignored
+    const char* file_name = server->input + 2;
+    size_t size = strlen(file_name);
+    const char* name = file_name + strspn(file_name, "/");
+
+    //fprintf(stdout, "DEBUG: File asked for is %s\n", name); fflush(stdout);
+
+    // Options follow the mode string
+    const char* mode_string = server->input + size + 3;
+    transfer_options options;
+    parse_options(server, size + 3 + strlen(mode_string) + 1, &options);
+
+    mode md = get_mode((char*)mode_string);
+    if (md != netascii && md != octet)
+    {
+        send_error(server, ILLEGAL_OP);
+        return;
+    }
+
+    // A cached file the index has seen no change to is used as it is, 
+    // and a file the index does not have is missing, with no syscall
+    bool missing;
+    cached_file* file = lookup_file(server->cache, name, &missing);
+    if (missing)
+    {
+        send_error(server, NO_FILE);
+        return;
+    }
+    struct stat file_stat;
+    int32_t fd = -1;
+    if (file == NULL)
+    {
+        // The kernel keeps the path beneath the root. If file was not 
+        // found, we tell the client.
+        fd = open_beneath(server->cache->root_fd, name, O_RDONLY | O_CLOEXEC);
+        if (ERROR(fd) || ERROR(fstat(fd, &file_stat)) || !S_ISREG(file_stat.st_mode))
+        {
+            //fprintf(stdout, "DEBUG: File does not exists\n"); fflush(stdout);
+            bool outside = ERROR(fd) && (errno == EXDEV || errno == ELOOP);
+            if (!ERROR(fd))
+            {
+                close(fd);
+            }
+            send_error(server, outside ? ACCESS_VIOLATION : NO_FILE);
+            return;
+        }
+
+        // Clients asking for the same file share one copy of it. If it
+        // is not cached, the transfer maps the file for itself.
+        file = acquire_file(server->cache, name, fd, &file_stat);
+        if (file == NULL)
+        {
+            file = map_file(fd, &file_stat);
+
+            // Read once, so the kernel may drop the pages behind the transfer
+            if (file != NULL && file->data != NULL)
+            {
+                madvise(file->data, file->size, MADV_SEQUENTIAL);
+            }
+        }
+
+        // Without read ahead of our own the event loop reads the file, 
+        // ask the kernel for the start of it now. With it, pages the 
+        // kernel is still reading would look in memory to read_ahead.
+        if (file == NULL || server->config->readers == 0)
+        {
+            posix_fadvise(fd, 0, READ_AHEAD, POSIX_FADV_WILLNEED);
+        }
+    }
+
+    // A netascii transfer of a cached file is sent from the file's
+    // netascii form, converted once for every client that asks. With 
+    // reader threads one of them converts it, and transfers until it is
+    // done are converted as they are sent, so the event loop never reads
+    // or converts the whole file.
+    bool converted = md == netascii && file != NULL && (server->readers == NULL ? 
+        prepare_netascii(file, fd) : queue_conversion(server, file));
+
+    // With -f a file that fits in one block is sent without a transfer
+    if (file != NULL && send_single(server, file, md, converted, &options, name))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    // Blocks converted as they are sent, and files that could not be 
+    // mapped, are read with pread, see read_to_buffer. The file is 
+    // opened again if the cache had it.
+    bool zero_copy = file != NULL && (md == octet || converted);
+    if (zero_copy && fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    else if (!zero_copy && fd < 0)
+    {
+        fd = open_beneath(server->cache->root_fd, name, O_RDONLY | O_CLOEXEC);
+        if (ERROR(fd))
+        {
+            release_file(file);
+            send_error(server, NO_FILE);
+            return;
+        }
+    }
+
+    // Allocate memory for a new client. Blocks sent from the mapping or 
+    // the netascii form are not copied, so the client only keeps headers.
+    // A file that is not mapped is read in the event loop, as nothing 
+    // can be read ahead into it. New transfers are refused once this 
+    // worker's share of -m is in use, or if a larger window than the 
+    // default can not be allocated.
+    client_value* new_client = server->slab.free == NULL ? NULL : 
+        init_client(&server->slab, server->config, md, &options, zero_copy);
+    if (new_client == NULL)
+    {
+        if (logging(WARN_LEVEL))
+        {
+            char address[ADDRESS_SIZE];
+            format_address(server->received_from, address);
+            log_event(WARN_LEVEL, "event=refused client=%s reason=%s", address, 
+                server->slab.free == NULL ? "too_many_transfers" : "out_of_memory");
+        }
+        if (file != NULL)
+        {
+            release_file(file);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        send_error(server, UNDEFINED);
+        return;
+    }
+    new_client->file = file;
+    new_client->fd = fd;
+    if (file != NULL)
+    {
+        new_client->source = converted ? file->netascii : file->data;
+        new_client->source_size = converted ? file->netascii_size : file->size;
+        new_client->resident = converted ? file->netascii_size : 0;
+    }
+    else
+    {
+        new_client->source_size = file_stat.st_size;
+        new_client->resident = file_stat.st_size;
+    }
+
+    new_client->started = server->now_us;
+
+    // The size is known up front unless netascii is converted as it is
+    // sent, line endings may then grow, so we leave tsize out of the OACK.
+    if (options.has_transfer_size)
+    {
+        if (new_client->zero_copy || md == octet)
+        {
+            options.transfer_size = new_client->source_size;
+        }
+        else
+        {
+            options.has_transfer_size = false;
+        }
+    }
+
+    // If the client asked for options we understand, we acknowledge them 
+    // and wait for ACK of block 0. Otherwise the first window of blocks 
+    // goes out right away.
+    if (options.has_block_size || options.has_window_size || 
+        options.has_timeout || options.has_transfer_size)
+    {
+        build_oack(new_client, &options);
+    }
+
+    // With -t the transfer gets a socket of its own and the client 
+    // talks to that from now on, or the server's if none can be had
+    memcpy(&new_client->address, server->received_from, sizeof(sockaddr_in));
+    bool own_socket = server->config->transfer_sockets && open_transfer_socket(server, new_client);
+    if (logging(INFO_LEVEL))
+    {
+        char address[ADDRESS_SIZE];
+        format_address(&new_client->address, address);
+        log_event(INFO_LEVEL, "event=start client=%s file=\"%s\" request=read mode=%s blksize=%u windowsize=%u socket=%s",
+            address, name, md == netascii ? "netascii" : "octet", options.block_size, options.window_size,
+            own_socket ? "own" : "shared");
+    }
+
+    // Send first pack(s)
+    send_window(server, new_client);
+
+    // Add client to client pool
+    insert_client(clients, pool_slot, new_client);
+}
+
+/*
+ * Read option (name, value) pairs, RFC 2347, from offset to the end of
+ * the packet. Unknown options and invalid values are ignored, which 
+ * leaves them out of the OACK.
+ */
+void parse_options(server_info* server, size_t offset, transfer_options* options)
+{
+    options->block_size = DEFAULT_BLOCK_SIZE;
+    options->window_size = 1;
+    options->timeout = 0;
+    options->transfer_size = 0;
+    options->has_block_size = false;
+    options->has_window_size = false;
+    options->has_timeout = false;
+    options->has_transfer_size = false;
+
+    while (offset < server->input_size)
+    {
+        const char* name = server->input + offset;
+        offset += strlen(name) + 1;
+        if (offset >= server->input_size)
+        {
+            break;
+        }
+        const char* value = server->input + offset;
+        offset += strlen(value) + 1;
+
+        // Block size, RFC 2348. Larger requests than we allow get our maximum.
+        if (!strcasecmp(name, "blksize"))
+        {
+            unsigned long block_size = strtoul(value, NULL, 10);
+            if (block_size >= MIN_BLOCK_SIZE)
+            {
+                options->block_size = block_size > MAX_BLOCK_SIZE ? MAX_BLOCK_SIZE : block_size;
+                options->has_block_size = true;
+            }
+        }
+        // Window size, RFC 7440
+        else if (!strcasecmp(name, "windowsize"))
+        {
+            unsigned long window_size = strtoul(value, NULL, 10);
+            if (window_size >= 1 && window_size <= 65535)
+            {
+                options->window_size = window_size > MAX_WINDOW_SIZE ? MAX_WINDOW_SIZE : window_size;
+                options->has_window_size = true;
+            }
+        }
+        // Timeout in seconds, RFC 2349
+        else if (!strcasecmp(name, "timeout"))
+        {
+            unsigned long timeout = strtoul(value, NULL, 10);
+            if (timeout >= 1 && timeout <= MAX_CLIENT_TIMEOUT)
+            {
+                options->timeout = timeout;
+                options->has_timeout = true;
+            }
+        }
+        // Transfer size, RFC 2349. The client sends 0 on RRQ and we 
+        // answer with the size once the file is open. On WRQ it is the
+        // size of the upload, which we answer with as it is.
+        else if (!strcasecmp(name, "tsize"))
+        {
+            options->transfer_size = strtoull(value, NULL, 10);
+            options->has_transfer_size = true;
+        }
+    }
+
+    // Bound the memory a single client can hold in its window
+    while (options->window_size > 1 && 
+        (size_t)options->window_size * (4 + options->block_size) > MAX_WINDOW_BYTES)
+    {
+        options->window_size--;
+    }
+}
+
+/*
+ * Put an OACK with the accepted options in the client's window. The
+ * OACK is block 0, the client acknowledges it with ACK 0.
+ */
+void build_oack(client_value* client, transfer_options* options)
+{
+    block_slot* slot = &client->window[0];
+    slot->size = format_oack(slot->data, options);
+    slot->payload_size = 0;
+    client->base = 0;
+}
+
+/*
+ * Write an OACK of the accepted options to buffer, returns its size.
+ */
+size_t format_oack(char* buffer, transfer_options* options)
+{
+    buffer[0] = 0;
+    buffer[1] = OACK;
+
+    size_t size = 2;
+    if (options->has_block_size)
+    {
+        size = append_option(buffer, size, "blksize", options->block_size);
+    }
+    if (options->has_window_size)
+    {
+        size = append_option(buffer, size, "windowsize", options->window_size);
+    }
+    if (options->has_timeout)
+    {
+        size = append_option(buffer, size, "timeout", options->timeout);
+    }
+    if (options->has_transfer_size)
+    {
+        size = append_option(buffer, size, "tsize", options->transfer_size);
+    }
+    return size;
+}
+
+/*
+ * Write "<name>\0<value>\0" to buffer at offset and return the new offset.
+ */
+size_t append_option(char* buffer, size_t offset, const char* name, uint64_t value)
+{
+    size_t name_size = strlen(name) + 1;
+    memcpy(buffer + offset, name, name_size);
+    offset += name_size;
+    return offset + sprintf(buffer + offset, "%" PRIu64, value) + 1;
+}
+
+/*
+ * Open name, relative to the directory root_fd, with the kernel keeping
+ * every step of the path beneath it, symbolic links and ".." included.
+ * A path that would leave it fails with EXDEV. Kernels before 5.6 have 
+ * no openat2, a name with a ".." in it is then refused the same way.
+ */
+int32_t open_beneath(int32_t root_fd, const char* name, int32_t flags)
+{
+    if (have_openat2)
+    {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int32_t fd = syscall(SYS_openat2, root_fd, name, &how, sizeof(how));
+        if (!ERROR(fd) || errno != ENOSYS)
+        {
+            return fd;
+        }
+        have_openat2 = false;
+    }
+
+    if (name[0] == '/' || strstr(name, "..") != NULL)
+    {
+        errno = EXDEV;
+        return -1;
+    }
+    return openat(root_fd, name, flags);
+}
+
+/*
+ * Convert string to mode enum.
+ */
+int32_t get_mode(char* str)
+{
+    size_t len = strlen(str);
+
+    // Convert mode to upper since all combinations of 
+    // upper and lower case digits should be supported
+    char upper[len + 1];
+    for (size_t i = 0; i < len; i++)
+    {
+        upper[i] = toupper(str[i]);
+    }
+    upper[len] = '\0';
+    //fprintf(stdout, "DEBUG: model = %s\n", upper); fflush(stdout);
+
+    // We only allow 'NETASCII' and 'OCTET'.
+    if (len == 8 && !strncmp("NETASCII", upper, 8))
+    {
+        return netascii;
+    }
+    else if (len == 5 && !strncmp("OCTET", upper, 5))
+    {
+        return octet;
+    }
+    else if (len == 4 && !strncmp("MAIL", upper, 4))
+    {
+        return mail;
+    }
+    else
+    {
+        return invalid;
+    }
+}
+
+/*
+ * Write the client's ip and port to buffer, which has room for ADDRESS_SIZE.
+ */
+void format_address(const sockaddr_in* address, char* buffer)
+{
+    char ip_buffer[16];
+    if (inet_ntop(AF_INET, &address->sin_addr, ip_buffer, sizeof(ip_buffer)) == NULL)
+    {
+        strcpy(ip_buffer, "?");
+    }
+    snprintf(buffer, ADDRESS_SIZE, "%s:%hu", ip_buffer, ntohs(address->sin_port));
+}
+
+/*
+ * Log the end of a transfer, with the bytes the client acknowledged, or
+ * we took from it, and how long it took. An upload is done once its
+ * file is in place, not when we stop waiting for the last block again.
+ */
+void log_transfer(server_info* server, client_value* client, transfer_result result)
+{
+    if (!logging(INFO_LEVEL))
+    {
+        return;
+    }
+
+    // Every block before base is full but the last one
+    uint64_t bytes = client->base > 1 ? (client->base - 1) * client->block_size : 0;
+    uint64_t ended = server->now_us;
+    if (client->upload != NULL)
+    {
+        bytes = client->upload->bytes;
+        ended = client->upload->finished != 0 ? client->upload->finished : ended;
+    }
+    else if (client->last_block != 0 && client->base > client->last_block)
+    {
+        block_slot* last = &client->window[client->last_block % client->window_size];
+        bytes = (client->last_block - 1) * client->block_size + last->size + last->payload_size - 4;
+    }
+
+    char address[ADDRESS_SIZE];
+    format_address(&client->address, address);
+    log_event(INFO_LEVEL, "event=end client=%s request=%s mode=%s bytes=%" PRIu64 " duration_ms=%" PRIu64 
+        " srtt_us=%" PRIu64 " timeout_ms=%" PRIu64 " result=%s",
+        address, client->upload != NULL ? "write" : "read", client->md == netascii ? "netascii" : "octet", 
+        bytes, (ended - client->started) / 1000, client->srtt, client->timeout, transfer_results[result]);
+}
+
+/*
+ * Send a file that fits in one DATA block without starting a transfer,
+ * if -f allows it. Without options the block goes out at once and only
+ * the client's address is kept, to know its ACK by. A client that does
+ * not get the block sends its RRQ again. 
+ * With -f record an OACK is sent instead if options were asked for, and
+ * a record of the block is kept until the client acknowledges it. With
+ * -f stateless options are ignored, as RFC 2347 allows. Returns false 
+ * if the transfer has to be started as usual, otherwise the file is 
+ * held until its block is sent.
+ */
+bool send_single(server_info* server, cached_file* file, mode md, bool converted, transfer_options* options, const char* name)
+{
+    // Only from the cache, netascii only from its converted form
+    single_mode single = server->config->single_block;
+    if (single == SINGLE_OFF || file->cache == NULL || (md == netascii && !converted))
+    {
+        return false;
+    }
+    const char* payload = md == netascii ? file->netascii : file->data;
+    uint64_t size = md == netascii ? file->netascii_size : file->size;
+    bool oack = single == SINGLE_RECORD && (options->has_block_size || options->has_window_size || 
+        options->has_timeout || options->has_transfer_size);
+    if (size >= (oack ? options->block_size : DEFAULT_BLOCK_SIZE))
+    {
+        return false;
+    }
+
+    // A slot taken by another client's record leaves this one to a transfer
+    single_record* record = NULL;
+    if (oack)
+    {
+        record = &server->singles[hash_address(server->received_from) & (SINGLE_RECORDS - 1)];
+        if (record->address.sin_port != 0 && server->now <= record->expires &&
+            (record->address.sin_port != server->received_from->sin_port ||
+            record->address.sin_addr.s_addr != server->received_from->sin_addr.s_addr))
+        {
+            return false;
+        }
+    }
+
+    METRIC_ADD(server->metrics.single_blocks, 1);
+    if (logging(INFO_LEVEL))
+    {
+        char address[ADDRESS_SIZE];
+        format_address(server->received_from, address);
+        log_event(INFO_LEVEL, "event=single client=%s file=\"%s\" mode=%s bytes=%lu oack=%s", address, name, 
+            md == netascii ? "netascii" : "octet", (unsigned long)size, oack ? "yes" : "no");
+    }
+
+    if (!oack)
+    {
+        block_slot slot;
+        slot.data = data_headers[1];
+        slot.size = 4;
+        slot.payload = payload;
+        slot.payload_size = size;
+        queue_block(server, server->reply_fd, &slot, server->received_from);
+        METRIC_ADD(server->metrics.bytes_sent, size);
+        hold_file(server, file);
+
+        // Whoever was in the slot before is taken for a stray from now on
+        single_sent* sent = &server->sent[hash_address(server->received_from) & (SINGLE_RECORDS - 1)];
+        memcpy(&sent->address, server->received_from, sizeof(sockaddr_in));
+        sent->expires = server->now + (uint64_t)server->config->max_timeout * (server->config->max_resends + 1);
+        return true;
+    }
+
+    // The same client asking again replaces its record
+    if (record->address.sin_port != 0)
+    {
+        // Its OACK may still be waiting to be sent
+        if (record->queued_at == server->flushes)
+        {
+            flush_packets(server);
+        }
+        free_single(server, record);
+    }
+
+    options->transfer_size = size;
+    memcpy(&record->address, server->received_from, sizeof(sockaddr_in));
+    record->file = file;
+    record->payload = payload;
+    record->payload_size = size;
+    record->oack_size = format_oack(record->oack, options);
+    uint64_t timeout = options->has_timeout ? (uint64_t)options->timeout * 1000 : server->config->max_timeout;
+    record->expires = server->now + timeout * (server->config->max_resends + 1);
+    record->queued_at = server->flushes;
+    queue_packet(server, server->reply_fd, record->oack, record->oack_size, server->received_from);
+    return true;
+}
+
+/*
+ * Take an ACK from a client with no transfer, if it is for a block sent
+ * by send_single. ACK 0 of a record's OACK is answered with the block,
+ * again if the client sends it again, and ACK 1 ends the record. ACK 1
+ * of a block sent without a record is taken from the address it went to,
+ * as often as it comes until the slot expires or is taken. Any other 
+ * ACK 1 is counted as stray. Returns false if the ACK is not for a 
+ * single block.
+ */
+bool acknowledge_single(server_info* server)
+{
+    uint16_t block_number = (unsigned char)server->input[3] + ((unsigned char)(server->input[2]) << 8);
+    single_record* record = find_single(server, server->received_from);
+    if (record != NULL && block_number == 0)
+    {
+        block_slot slot;
+        slot.data = data_headers[1];
+        slot.size = 4;
+        slot.payload = record->payload;
+        slot.payload_size = record->payload_size;
+        queue_block(server, server->reply_fd, &slot, server->received_from);
+        METRIC_ADD(server->metrics.bytes_sent, record->payload_size);
+        return true;
+    }
+    if (block_number == 1 && record != NULL)
+    {
+        free_single(server, record);
+        return true;
+    }
+    if (block_number == 1)
+    {
+        single_sent* sent = &server->sent[hash_address(server->received_from) & (SINGLE_RECORDS - 1)];
+        if (sent->address.sin_port == server->received_from->sin_port &&
+            sent->address.sin_addr.s_addr == server->received_from->sin_addr.s_addr && server->now <= sent->expires)
+        {
+            return true;
+        }
+        METRIC_ADD(server->metrics.stray_acks, 1);
+        if (logging(DEBUG_LEVEL))
+        {
+            char address[ADDRESS_SIZE];
+            format_address(server->received_from, address);
+            log_event(DEBUG_LEVEL, "event=stray_ack client=%s block=1", address);
+        }
+    }
+    return false;
+}
+
+/*
+ * The record of the client at address, NULL if it has none or it has 
+ * expired.
+ */
+single_record* find_single(server_info* server, const sockaddr_in* address)
+{
+    if (server->singles == NULL || address == NULL)
+    {
+        return NULL;
+    }
+    single_record* record = &server->singles[hash_address(address) & (SINGLE_RECORDS - 1)];
+    if (record->address.sin_port != address->sin_port || record->address.sin_addr.s_addr != address->sin_addr.s_addr)
+    {
+        return NULL;
+    }
+    if (server->now > record->expires)
+    {
+        free_single(server, record);
+        return NULL;
+    }
+    return record;
+}
+
+/*
+ * Free a record. Its block may still be queued, so the file is held
+ * until the next flush.
+ */
+void free_single(server_info* server, single_record* record)
+{
+    hold_file(server, record->file);
+    record->address.sin_port = 0;
+    record->file = NULL;
+}
+
+/*
+ * Keep a user of file until the packets queued so far are sent, see 
+ * flush_packets.
+ */
+void hold_file(server_info* server, cached_file* file)
+{
+    if (server->held_count == 2 * server->config->batch_size)
+    {
+        flush_packets(server);
+    }
+    server->held[server->held_count++] = file;
+}
+
+/*
+ * Deal with ACK packates for already existing clients.
+ */
+void continue_existing_transfer(client_table* clients, server_info* server)
+{
+    // If client does not exist, he should not be sending ACKs
+    client_value* client = lookup_client(clients, server->received_from);
+    if (client == NULL && server->config->single_block != SINGLE_OFF && acknowledge_single(server))
+    {
+        return;
+    }
+    if (client == NULL)
+    {
+        //fprintf(stdout, "DEBUG: ACK from unknown source\n"); fflush(stdout);
+        send_error(server, UNKNOWN_ID);
+        return;
+    }
+
+    acknowledge_block(clients, server, client);
+}
+
+/*
+ * Move the client's transfer along by the ACK in the input buffer.
+ * Returns false if the transfer is over and the client was removed.
+ */
+bool acknowledge_block(client_table* clients, server_info* server, client_value* client)
+{
+    // An upload is acknowledged by us, not the client
+    if (client->upload != NULL)
+    {
+        send_error(server, ILLEGAL_OP);
+        return true;
+    }
+
+    // Byte 2: aaaa-bbbb
+    // Byte 3: cccc-dddd
+    // Block number: aaaa-bbbb-cccc-dddd
+    uint16_t block_number = (unsigned char)server->input[3] + ((unsigned char)(server->input[2]) << 8);
+
+    //fprintf(stdout, "DEBUG: BN = (%hu,%lu)\n", block_number, client->base); fflush(stdout);
+
+    // If the ACK is stale (for a block acknowledged before) or does not 
+    // match anything we sent, the client missed the first block in the window
+    uint64_t acked;
+    if (!find_acked_block(client, block_number, &acked) || acked < client->base)
+    {
+        //fprintf(stdout, "DEBUG: Block number mismatch\n"); fflush(stdout);
+
+        // A client may ACK every block it gets out of order after a loss. We
+        // already went back for this block, so we ignore the rest of them
+        // or each would resend the window and cause more. If the resent
+        // window is lost as well, our timer resends it again.
+        if (client->rewound_base == client->base)
+        {
+            return true;
+        }
+        client->rewound_base = client->base;
+
+        // Check if too many resends already. If so, send error and remove
+        // client from client pool. Otherwise go back and resend the window.
+        if (client->resends++ == server->config->max_resends)
+        {
+            //fprintf(stdout, "DEBUG: Resends depleted\n"); fflush(stdout);
+            send_error(server, UNDEFINED);
+            remove_client(clients, server, client, ERROR_RESULT);
+            return false;
+        }
+
+        if (logging(DEBUG_LEVEL))
+        {
+            char address[ADDRESS_SIZE];
+            format_address(&client->address, address);
+            log_event(DEBUG_LEVEL, "event=resend client=%s block=%" PRIu64 " reason=ack_%hu", 
+                address, client->base, block_number);
+        }
+        client->next = client->base;
+        send_window(server, client);
+        return true;
+    }
+
+    // The ACK is for something we sent, which may end a round trip
+    time_ack(server, client, acked);
+
+    // Check if transfer is done and if so, remove client from pool. 
+    if (client->last_block != 0 && acked == client->last_block)
+    {
+        //fprintf(stdout, "DEBUG: Last package confirmed\n"); fflush(stdout);
+        client->base = acked + 1;
+        remove_client(clients, server, client, DONE_RESULT);
+        return false;
+    }
+    
+    // If block number match, we reset resends
+    client->resends = 0;
+
+    // Progress, so the timer starts over
+    client->rewound_base = UINT64_MAX;
+
+    // Slide the window. An ACK short of the last block sent means the
+    // blocks after it were lost, so we go back and send from there.
+    client->base = acked + 1;
+    if (client->next > client->base)
+    {
+        client->next = client->base;
+    }
+
+    // Send next package(s)
+    send_window(server, client);
+    return true;
+}
+
+/*
+ * Handling of WRQ requests, taken with -u only. The upload is written
+ * to a temporary file next to the one asked for, which is renamed to it
+ * once every block is on disk, so readers see the old file or the new
+ * one and never a part of it. If valid, client is added to pool.
+ */
+void start_upload(client_table* clients, server_info* server)
+{
+    // Refused, as every WRQ was before uploads
+    if (!server->config->uploads)
+    {
+        send_error(server, ACCESS_VIOLATION);
+        return;
+    }
+
+    // A client sends its WRQ again if our OACK or ACK 0 was lost, which
+    // we send again. A WRQ in the middle of a transfer ends it.
+    table_slot* pool_slot = find_client_slot(clients, server->received_from);
+    client_value* client = pool_slot->client;
+    if (client != NULL)
+    {
+        if (client->upload == NULL || client->base > 1)
+        {
+            send_error(server, ILLEGAL_OP);
+            remove_client(clients, server, client, ERROR_RESULT);
+        }
+        else if (client->resends++ == server->config->max_resends)
+        {
+            send_error(server, UNDEFINED);
+            remove_client(clients, server, client, ERROR_RESULT);
+        }
+        else
+        {
+            send_upload_reply(server, client);
+        }
+        return;
+    }
+
+    METRIC_ADD(server->metrics.uploads, 1);
+
+    // Refuse new transfers once this worker's share of -m is in use
+    if (server->slab.free == NULL)
+    {
+        if (logging(WARN_LEVEL))
+        {
+            char address[ADDRESS_SIZE];
+            format_address(server->received_from, address);
+            log_event(WARN_LEVEL, "event=refused client=%s reason=too_many_transfers", address);
+        }
+        send_error(server, UNDEFINED);
+        return;
+    }
+
+    // The file name is relative to the root, a leading '/' is ignored
+    const char* file_name = server->input + 2;
+    size_t size = strlen(file_name);
+    const char* name = file_name + strspn(file_name, "/");
+
+    // Options follow the mode string
+    const char* mode_string = server->input + size + 3;
+    transfer_options options;
+    parse_options(server, size + 3 + strlen(mode_string) + 1, &options);
+
+    mode md = get_mode((char*)mode_string);
+    if (md != netascii && md != octet)
+    {
+        send_error(server, ILLEGAL_OP);
+        return;
+    }
+
+    // Blocks must fit in an input buffer and a window in a chunk, see has_room
+    if (options.block_size > MAX_UPLOAD_BLOCK_SIZE)
+    {
+        options.block_size = MAX_UPLOAD_BLOCK_SIZE;
+    }
+    while (options.window_size > 1 && (size_t)options.window_size * options.block_size > UPLOAD_CHUNK)
+    {
+        options.window_size--;
+    }
+
+    int32_t err = 0;
+    upload_state* upload = create_upload(server->cache->root_fd, name, &err);
+    if (upload == NULL)
+    {
+        send_error(server, upload_error(err));
+        return;
+    }
+
+    // An upload that tells its size up front and does not fit is refused
+    struct statvfs disk;
+    if (options.has_transfer_size && !ERROR(fstatvfs(upload->fd, &disk)) &&
+        options.transfer_size > (uint64_t)disk.f_bavail * disk.f_frsize)
+    {
+        discard_upload(upload);
+        send_error(server, DISK_FULL);
+        return;
+    }
+
+    // Nothing is sent but the replies in slot 0 of the window, so no
+    // buffer is needed for blocks
+    client_value* new_client = init_client(&server->slab, server->config, md, &options, true);
+    if (new_client == NULL)
+    {
+        if (logging(WARN_LEVEL))
+        {
+            char address[ADDRESS_SIZE];
+            format_address(server->received_from, address);
+            log_event(WARN_LEVEL, "event=refused client=%s reason=out_of_memory", address);
+        }
+        discard_upload(upload);
+        send_error(server, UNDEFINED);
+        return;
+    }
+    new_client->upload = upload;
+    new_client->started = server->now_us;
+
+    // The OACK stands for ACK 0 if the client asked for options we
+    // understand, either way the first block is 1
+    if (options.has_block_size || options.has_window_size || 
+        options.has_timeout || options.has_transfer_size)
+    {
+        build_oack(new_client, &options);
+        new_client->base = 1;
+    }
+    else
+    {
+        block_slot* slot = &new_client->window[0];
+        memset(slot->data, 0, 4);
+        slot->data[1] = ACK;
+        slot->size = 4;
+    }
+
+    // With -t the transfer gets a socket of its own, as for reads
+    memcpy(&new_client->address, server->received_from, sizeof(sockaddr_in));
+    bool own_socket = server->config->transfer_sockets && open_transfer_socket(server, new_client);
+    if (logging(INFO_LEVEL))
+    {
+        char address[ADDRESS_SIZE];
+        format_address(&new_client->address, address);
+        log_event(INFO_LEVEL, "event=start client=%s file=\"%s\" request=write mode=%s blksize=%u windowsize=%u socket=%s",
+            address, name, md == netascii ? "netascii" : "octet", options.block_size, options.window_size,
+            own_socket ? "own" : "shared");
+    }
+
+    send_upload_reply(server, new_client);
+    new_client->timed_block = 1;
+    new_client->timed_at = server->now_us;
+    insert_client(clients, pool_slot, new_client);
+}
+
+/*
+ * Deal with DATA packets for uploads already started.
+ */
+void continue_upload(client_table* clients, server_info* server)
+{
+    // If client does not exist, he should not be sending DATA
+    client_value* client = lookup_client(clients, server->received_from);
+    if (client == NULL)
+    {
+        send_error(server, UNKNOWN_ID);
+        return;
+    }
+
+    receive_block(clients, server, client);
+}
+
+/*
+ * Take the DATA block in the input buffer for the client's upload.
+ * Blocks are taken in order and acknowledged a window at a time, RFC
+ * 7440. Anything out of order gets the ACK of the last block taken, 
+ * once, so the client goes back to the block after it. Returns false 
+ * if the transfer is over and the client was removed.
+ */
+bool receive_block(client_table* clients, server_info* server, client_value* client)
+{
+    upload_state* upload = client->upload;
+    if (upload == NULL || server->input_size < 4)
+    {
+        send_error(server, ILLEGAL_OP);
+        return true;
+    }
+
+    // Byte 2: aaaa-bbbb
+    // Byte 3: cccc-dddd
+    // Block number: aaaa-bbbb-cccc-dddd
+    uint16_t block_number = (unsigned char)server->input[3] + ((unsigned char)(server->input[2]) << 8);
+    size_t size = server->input_size - 4;
+
+    // Clients number the blocks after 65535 from 0 or from 1
+    bool next = client->last_block == 0 && 
+        (block_number == wire_block_number(client->base) || block_number == (uint16_t)client->base);
+    if (!next)
+    {
+        // The last block came again, our ACK of it was lost
+        if (upload->finished != 0)
+        {
+            send_upload_reply(server, client);
+        }
+        // Not while the disk holds the ACK up, or after the last block
+        else if (client->last_block == 0 && !upload->ack_held && client->rewound_base != client->base)
+        {
+            client->rewound_base = client->base;
+            if (client->base == 1)
+            {
+                send_upload_reply(server, client);
+            }
+            else if (has_room(client))
+            {
+                acknowledge_upload(server, client);
+            }
+        }
+        return true;
+    }
+
+    if (size > client->block_size)
+    {
+        send_error(server, ILLEGAL_OP);
+        remove_client(clients, server, client, ERROR_RESULT);
+        return false;
+    }
+
+    // Progress, so the timer starts over, from a new estimate if our
+    // last reply was timed
+    time_ack(server, client, client->base);
+    client->resends = 0;
+    client->rewound_base = UINT64_MAX;
+    schedule_timer(&server->wheel, &client->timer, server->now + client->timeout);
+
+    upload->last_number = block_number;
+    upload->in_window++;
+    upload->bytes += size;
+    METRIC_ADD(server->metrics.bytes_received, size);
+    store_payload(server, client, server->input + 4, size);
+    client->base++;
+
+    // A short block is the last. What is left is written and the file
+    // synced and renamed before it is acknowledged, see advance_upload.
+    if (size < client->block_size)
+    {
+        client->last_block = client->base - 1;
+        if (upload->carry)
+        {
+            upload->carry = false;
+            append_upload(server, client, "\r", 1);
+        }
+        if (upload->sizes[upload->filling] > 0)
+        {
+            write_chunk(server, client);
+        }
+    }
+    else if (upload->in_window == client->window_size)
+    {
+        // Letting the client send the next window needs room for it
+        if (has_room(client))
+        {
+            acknowledge_upload(server, client);
+        }
+        else
+        {
+            upload->ack_held = true;
+            server->write_stalls++;
+        }
+    }
+
+    return advance_upload(clients, server, client);
+}
+
+/*
+ * Add a block's payload to the client's upload, netascii turned back
+ * into the server's line endings.
+ */
+void store_payload(server_info* server, client_value* client, const char* data, size_t size)
+{
+    char decoded[MAX_UPLOAD_BLOCK_SIZE + 1];
+    if (client->md == netascii)
+    {
+        size = netascii_decode(data, size, decoded, &client->upload->carry);
+        data = decoded;
+    }
+    append_upload(server, client, data, size);
+}
+
+/*
+ * Copy data into the chunk being filled. Each chunk that fills up is
+ * written as a whole, at an offset that is a multiple of UPLOAD_CHUNK.
+ */
+void append_upload(server_info* server, client_value* client, const char* data, size_t size)
+{
+    upload_state* upload = client->upload;
+    while (size > 0 && upload->error == 0)
+    {
+        uint32_t chunk = upload->filling;
+        size_t n = UPLOAD_CHUNK - upload->sizes[chunk];
+        n = size < n ? size : n;
+        memcpy(upload->chunks[chunk] + upload->sizes[chunk], data, n);
+        upload->sizes[chunk] += n;
+        data += n;
+        size -= n;
+        if (upload->sizes[chunk] == UPLOAD_CHUNK)
+        {
+            write_chunk(server, client);
+        }
+    }
+}
+
+/*
+ * Whether the chunks have room for another window from the client. The
+ * ACK that lets the client send it waits until they do, so a chunk is
+ * never filled while it is being written.
+ */
+bool has_room(client_value* client)
+{
+    upload_state* upload = client->upload;
+    size_t room = UPLOAD_CHUNK - upload->sizes[upload->filling];
+    if (!upload->writing[1 - upload->filling])
+    {
+        room += UPLOAD_CHUNK;
+    }
+
+    // Decoding netascii may add a held '\r' to a window
+    return room > (size_t)client->window_size * client->block_size;
+}
+
+/*
+ * Hand the chunk being filled to the disk and, unless the last block
+ * is in, go on filling the other one. Its memory is only allocated once
+ * an upload needs more than one chunk.
+ */
+void write_chunk(server_info* server, client_value* client)
+{
+    upload_state* upload = client->upload;
+    uint32_t chunk = upload->filling;
+    upload->offsets[chunk] = upload->end;
+    upload->end += upload->sizes[chunk];
+    upload->writing[chunk] = true;
+    upload->submitted[chunk] = monotonic_us();
+    server->chunks_written++;
+    start_io(server, client, WRITE_IO, chunk);
+
+    if (client->last_block != 0)
+    {
+        return;
+    }
+    upload->filling = 1 - chunk;
+    upload->sizes[upload->filling] = 0;
+    if (upload->chunks[upload->filling] == NULL &&
+        posix_memalign((void**)&upload->chunks[upload->filling], sysconf(_SC_PAGESIZE), UPLOAD_CHUNK) != 0)
+    {
+        upload->chunks[upload->filling] = NULL;
+        upload->error = ENOMEM;
+    }
+}
+
+/*
+ * Hand a write of one of the client's chunks, or the sync of its file,
+ * to the worker's io_uring or the reader threads. With neither, or if
+ * it can not be queued, it is done here in the event loop.
+ */
+void start_io(server_info* server, client_value* client, io_kind kind, uint32_t chunk)
+{
+    upload_state* upload = client->upload;
+    upload->in_flight++;
+    server->writes_in_flight++;
+
+    if (server->ring.fd >= 0)
+    {
+        struct io_uring_sqe request;
+        memset(&request, 0, sizeof(request));
+        request.fd = upload->fd;
+        if (kind == WRITE_IO)
+        {
+            request.opcode = IORING_OP_WRITE;
+            request.addr = (uintptr_t)upload->chunks[chunk];
+            request.len = upload->sizes[chunk];
+            request.off = upload->offsets[chunk];
+        }
+        else
+        {
+            request.opcode = IORING_OP_FSYNC;
+            request.fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+
+        // Client values are 8 byte aligned, which leaves the low bits
+        request.user_data = (uintptr_t)client | kind | chunk << 2;
+        if (submit_ring(server, &request))
+        {
+            return;
+        }
+    }
+    else if (server->readers != NULL)
+    {
+        read_job* job = (read_job*)malloc(sizeof(read_job));
+        if (job != NULL)
+        {
+            job->next = NULL;
+            job->server = server;
+            job->client = client;
+            job->kind = kind;
+            job->start = upload->chunks[chunk];
+            job->size = upload->sizes[chunk];
+            job->offset = upload->offsets[chunk];
+            job->fd = upload->fd;
+            job->chunk = chunk;
+            job->result = 0;
+            queue_job(server->readers, job);
+            return;
+        }
+    }
+
+    complete_io(server, client, kind, chunk, 
+        run_upload_io(upload->fd, kind, upload->chunks[chunk], upload->sizes[chunk], upload->offsets[chunk]));
+}
+
+/*
+ * Write size bytes of data to fd at offset, or sync fd. Returns the
+ * bytes written, 0 for a sync, or -errno.
+ */
+int32_t run_upload_io(int32_t fd, io_kind kind, const char* data, size_t size, uint64_t offset)
+{
+    if (kind == SYNC_IO)
+    {
+        return ERROR(fdatasync(fd)) ? -errno : 0;
+    }
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pwrite(fd, data + done, size - done, offset + done);
+        if (ERROR(n) && errno == EINTR)
+        {
+            continue;
+        }
+        if (ERROR(n))
+        {
+            return -errno;
+        }
+        if (n == 0)
+        {
+            return -ENOSPC;
+        }
+        done += n;
+    }
+    return (int32_t)done;
+}
+
+/*
+ * Account for a write or sync of the client's upload being done, with 
+ * what it returned. A short write is taken as a full disk.
+ */
+void complete_io(server_info* server, client_value* client, io_kind kind, uint32_t chunk, int32_t result)
+{
+    upload_state* upload = client->upload;
+    upload->in_flight--;
+    server->writes_in_flight--;
+    if (kind == SYNC_IO)
+    {
+        upload->synced = true;
+    }
+    else
+    {
+        upload->writing[chunk] = false;
+        record_value(&server->metrics.write_time, monotonic_us() - upload->submitted[chunk]);
+        if (result >= 0)
+        {
+            METRIC_ADD(server->metrics.bytes_written, result);
+            if ((size_t)result < upload->sizes[chunk])
+            {
+                result = -ENOSPC;
+            }
+        }
+    }
+
+    if (result < 0 && upload->error == 0)
+    {
+        upload->error = -result;
+    }
+}
+
+/*
+ * A write or sync of an upload done by io_uring or a reader thread. 
+ * The upload moves on unless it was removed meanwhile.
+ */
+void finish_write(client_table* clients, server_info* server, client_value* client, io_kind kind, uint32_t chunk, int32_t result)
+{
+    complete_io(server, client, kind, chunk, result);
+
+    // Removed while it was writing, it is freed with the other closed ones
+    if (!server_loop || lookup_client(clients, &client->address) != client)
+    {
+        return;
+    }
+
+    reply_to_client(server, client);
+    advance_upload(clients, server, client);
+}
+
+/*
+ * Move an upload along as far as its writes allow. A failed write ends
+ * it, a held ACK goes out once there is room for the next window, and
+ * once everything is written the file is synced and put in place. 
+ * Returns false if the transfer is over and the client was removed.
+ */
+bool advance_upload(client_table* clients, server_info* server, client_value* client)
+{
+    upload_state* upload = client->upload;
+    if (upload->error == 0 && client->last_block != 0 && upload->in_flight == 0 && !upload->synced)
+    {
+        start_io(server, client, SYNC_IO, 0);
+    }
+
+    if (upload->error != 0)
+    {
+        send_error(server, upload_error(upload->error));
+        remove_client(clients, server, client, ERROR_RESULT);
+        return false;
+    }
+
+    if (client->last_block != 0)
+    {
+        if (upload->in_flight == 0 && upload->finished == 0)
+        {
+            return finish_upload(clients, server, client);
+        }
+        return true;
+    }
+
+    if (upload->ack_held && has_room(client))
+    {
+        upload->ack_held = false;
+        acknowledge_upload(server, client);
+    }
+    return true;
+}
+
+/*
+ * Every block of the upload is on disk, put the file in place of the
+ * one asked for and acknowledge the last block. The client is kept for
+ * a timeout, in case that ACK is lost and the last block comes again.
+ * Returns false if the transfer is over and the client was removed.
+ */
+bool finish_upload(client_table* clients, server_info* server, client_value* client)
+{
+    upload_state* upload = client->upload;
+    if (ERROR(renameat(upload->dir_fd, upload->temp_name, upload->dir_fd, upload->name)))
+    {
+        send_error(server, upload_error(errno));
+        remove_client(clients, server, client, ERROR_RESULT);
+        return false;
+    }
+
+    // Indexed now, a read request right after is not told it is missing
+    file_cache* cache = server->cache;
+    if (canonical_name(upload->path))
+    {
+        pthread_mutex_lock(&cache->lock);
+        if (cache->index.ready)
+        {
+            index_path(cache, upload->path, NULL);
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    upload->finished = server->now_us;
+    record_value(&server->metrics.upload_duration, upload->finished - client->started);
+    acknowledge_upload(server, client);
+    return true;
+}
+
+/*
+ * Acknowledge the last block taken, from slot 0 of the window where the
+ * OACK or ACK 0 was.
+ */
+void acknowledge_upload(server_info* server, client_value* client)
+{
+    // The slot may still be queued for sending from earlier in this batch
+    block_slot* slot = &client->window[0];
+    if (slot->queued_at == server->flushes)
+    {
+        flush_packets(server);
+    }
+
+    slot->data[0] = 0;
+    slot->data[1] = ACK;
+    slot->data[2] = client->upload->last_number >> 8;
+    slot->data[3] = client->upload->last_number & 0xff;
+    slot->size = 4;
+    slot->payload_size = 0;
+    client->upload->in_window = 0;
+    send_upload_reply(server, client);
+    client->timed_block = client->base;
+    client->timed_at = server->now_us;
+}
+
+/*
+ * Send the upload's last reply, again or for the first time, and wait
+ * a timeout for the next block. A reply sent again is not timed, see 
+ * time_ack, so a new one is timed by the caller once it is sent.
+ */
+void send_upload_reply(server_info* server, client_value* client)
+{
+    schedule_timer(&server->wheel, &client->timer, server->now + client->timeout);
+    client->timed_block = 0;
+
+    // From the transfer's own socket if it has one
+    int32_t fd = client->event.fd >= 0 ? client->event.fd : server->fd;
+    sockaddr_in* to = client->event.fd >= 0 ? NULL : &client->address;
+    queue_block(server, fd, &client->window[0], to);
+    client->window[0].queued_at = server->flushes;
+}
+
+/*
+ * Upload's deadline has passed. Once its file is in place the client
+ * is done. While a write holds us up we wait on, that is not the 
+ * client's doing. Otherwise the ACK of the last block taken is sent 
+ * again with the timeout backed off, or the client is removed if it has
+ * run out of resends.
+ */
+void expire_upload(client_table* clients, server_info* server, client_value* client)
+{
+    upload_state* upload = client->upload;
+    if (upload->finished != 0)
+    {
+        remove_client(clients, server, client, DONE_RESULT);
+        return;
+    }
+    if (upload->ack_held || client->last_block != 0)
+    {
+        schedule_timer(&server->wheel, &client->timer, server->now + client->timeout);
+        return;
+    }
+
+    METRIC_ADD(server->metrics.timeouts, 1);
+    reply_to_client(server, client);
+    if (client->resends++ == server->config->max_resends)
+    {
+        send_error(server, UNDEFINED);
+        remove_client(clients, server, client, TIMEOUT_RESULT);
+        return;
+    }
+
+    if (logging(DEBUG_LEVEL))
+    {
+        char address[ADDRESS_SIZE];
+        format_address(&client->address, address);
+        log_event(DEBUG_LEVEL, "event=resend client=%s block=%" PRIu64 " reason=timeout timeout_ms=%" PRIu64, 
+            address, client->base - 1, client->timeout);
+    }
+    back_off(server->config, client);
+    if (upload->in_window > 0 && has_room(client))
+    {
+        acknowledge_upload(server, client);
+    }
+    else
+    {
+        send_upload_reply(server, client);
+    }
+}
+
+/*
+ * Create the temporary file for an upload to path, relative to the root,
+ * as ".<name>.<pid>.<count>" in the same directory so the rename is 
+ * atomic, the count shared by the workers so no two pick one name, and
+ * the memory for its first chunk, page aligned. The directory is opened
+ * beneath the root and the file made in it, so the upload can not leave
+ * the root either. Returns NULL, with errno in err, if either can not 
+ * be had or the file is there and not a regular file.
+ */
+upload_state* create_upload(int32_t root_fd, const char* path, int32_t* err)
+{
+    upload_state* upload = (upload_state*)calloc(1, sizeof(upload_state));
+    if (upload == NULL)
+    {
+        *err = ENOMEM;
+        return NULL;
+    }
+    upload->fd = upload->dir_fd = -1;
+
+    // The name is what follows the last '/', the directory what precedes it
+    const char* name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+    char* dir = strndup(path, name - path);
+    upload->path = strdup(path);
+    upload->name = strdup(name);
+    upload->temp_name = (char*)malloc(strlen(name) + 21);
+    if (dir == NULL || upload->path == NULL || upload->name == NULL || upload->temp_name == NULL ||
+        posix_memalign((void**)&upload->chunks[0], sysconf(_SC_PAGESIZE), UPLOAD_CHUNK) != 0)
+    {
+        free(dir);
+        upload->chunks[0] = NULL;
+        discard_upload(upload);
+        *err = ENOMEM;
+        return NULL;
+    }
+    upload->dir_fd = open_beneath(root_fd, dir[0] != '\0' ? dir : ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (ERROR(upload->dir_fd))
+    {
+        *err = errno == EXDEV || errno == ELOOP ? EACCES : errno;
+        discard_upload(upload);
+        return NULL;
+    }
+
+    // Nothing but a regular file is replaced, a symbolic link is not followed
+    struct stat file_stat;
+    if (name[0] == '\0' || !strcmp(name, ".") || !strcmp(name, "..") ||
+        (!ERROR(fstatat(upload->dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW)) && !S_ISREG(file_stat.st_mode)))
+    {
+        *err = EISDIR;
+        discard_upload(upload);
+        return NULL;
+    }
+
+    // A name left by an earlier run with the same pid is tried again with the next count
+    for (uint32_t tries = 0; upload->fd < 0 && tries < 16; tries++)
+    {
+        sprintf(upload->temp_name, ".%s.%x.%x", name, (uint32_t)getpid(), 
+            __atomic_fetch_add(&upload_names, 1, __ATOMIC_RELAXED));
+        upload->fd = openat(upload->dir_fd, upload->temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, UPLOAD_MODE);
+        if (ERROR(upload->fd) && errno != EEXIST)
+        {
+            break;
+        }
+    }
+    if (ERROR(upload->fd))
+    {
+        *err = errno;
+        discard_upload(upload);
+        return NULL;
+    }
+    return upload;
+}
+
+/*
+ * Close and free an upload. Its temporary file is removed unless it
+ * was put in place.
+ */
+void discard_upload(upload_state* upload)
+{
+    if (upload->fd >= 0)
+    {
+        close(upload->fd);
+        if (upload->finished == 0)
+        {
+            unlinkat(upload->dir_fd, upload->temp_name, 0);
+        }
+    }
+    if (upload->dir_fd >= 0)
+    {
+        close(upload->dir_fd);
+    }
+    free(upload->chunks[0]);
+    free(upload->chunks[1]);
+    free(upload->path);
+    free(upload->name);
+    free(upload->temp_name);
+    free(upload);
+}
+
+/*
+ * The error code sent for a file that could not be created or written.
+ */
+error_code upload_error(int32_t err)
+{
+    switch (err)
+    {
+        case ENOENT:
+        case ENOTDIR:
+            return NO_FILE;
+        case EACCES:
+        case EPERM:
+        case EROFS:
+        case EISDIR:
+            return ACCESS_VIOLATION;
+        case ENOSPC:
+        case EDQUOT:
+        case EFBIG:
+            return DISK_FULL;
+        default:
+            return UNDEFINED;
+    }
+}
+
+/*
+ * Time from the client's request to its first OACK or DATA block being
+ * queued, once per transfer. The clock is read now and the request was
+ * stamped as it was received, so opening, converting and reading the 
+ * file are counted, and the client's round trip to ACK an OACK is not.
+ */
+void first_reply(server_info* server, client_value* client)
+{
+    if (!client->replied)
+    {
+        client->replied = true;
+        record_value(&server->metrics.first_block, monotonic_us() - client->started);
+    }
+}
+
+/*
+ * Send blocks from next until the window is full or the file is done.
+ * Blocks already in the window are resent as they are, new ones are
+ * read from file into the slot of the block that dropped out of it.
+ */
+void send_window(server_info* server, client_value* client)
+{
+    // Resend if nothing is acknowledged before the deadline
+    schedule_timer(&server->wheel, &client->timer, server->now + client->timeout);
+
+    // From the transfer's own socket if it has one
+    int32_t fd = client->event.fd >= 0 ? client->event.fd : server->fd;
+    sockaddr_in* to = client->event.fd >= 0 ? NULL : &client->address;
+
+    // Nothing but the OACK until it is acknowledged, the first blocks
+    // are read ahead in the meantime. The OACK is block 0 sent, also
+    // when resent from next = base, or its ACK would not be found.
+    if (client->base == 0)
+    {
+        client->next = 1;
+        queue_block(server, fd, &client->window[0], to);
+        client->window[0].queued_at = server->flushes;
+        first_reply(server, client);
+        read_ahead(server, client);
+        return;
+    }
+
+    for (; client->next < client->base + client->window_size; client->next++)
+    {
+        if (client->last_block != 0 && client->next > client->last_block)
+        {
+            break;
+        }
+
+        block_slot* slot = &client->window[client->next % client->window_size];
+        if (client->next > client->read)
+        {
+            // If the block is still on disk we send on once it is read
+            if (!read_ahead(server, client))
+            {
+                if (!client->stalled)
+                {
+                    server->read_stalls++;
+                }
+                client->stalled = true;
+                break;
+            }
+
+            // The slot may still be queued for sending from earlier in this batch,
+            // other blocks of the window stay queued so they go out together
+            if (slot->queued_at == server->flushes)
+            {
+                flush_packets(server);
+            }
+
+            // Read next block from client's file descriptor
+            read_to_buffer(server, client, slot, client->next);
+            client->read = client->next;
+            if (slot->size + slot->payload_size < 4 + (size_t)client->block_size)
+            {
+                client->last_block = client->next;
+            }
+
+            // Time the ACK of this block if none is timed, see time_ack
+            if (client->next == 1)
+            {
+                first_reply(server, client);
+            }
+            if (client->timed_block == 0)
+            {
+                client->timed_block = client->next;
+                client->timed_at = server->now_us;
+            }
+        }
+        else
+        {
+            METRIC_ADD(server->metrics.retransmits, 1);
+            if (client->timed_block == client->next)
+            {
+                client->timed_block = 0;
+            }
+        }
+
+        queue_block(server, fd, slot, to);
+        slot->queued_at = server->flushes;
+        METRIC_ADD(server->metrics.bytes_sent, slot->size + slot->payload_size - 4);
+    }
+}
+
+/*
+ * Find the block an ACK refers to. It is either the block acknowledged
+ * last, base - 1, or one sent since. Returns false if no such block.
+ */
+bool find_acked_block(client_value* client, uint16_t block_number, uint64_t* block)
+{
+    uint64_t first = client->base == 0 ? 0 : client->base - 1;
+    for (uint64_t b = client->next; b-- > first; )
+    {
+        if (wire_block_number(b) == block_number)
+        {
+            *block = b;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Block number as sent, 16 bits, circular ignoring 0 which is the OACK.
+ */
+uint16_t wire_block_number(uint64_t block)
+{
+    return block == 0 ? 0 : (uint16_t)((block - 1) % 65535 + 1);
+}
+
+/*
+ * Read file to packet. If mode is netascii we replace '\n' and '\r'
+ * with '\r\n' and '\r\n' respectively. Octet is an agreement to send
+ * files as is. Netascii however expects windows line endings. Tftp
+ * clients will remove '\r' when running on Unix so not replacing '\n'
+ * with '\r\n' does not matter but for a windows client, it would miss
+ * the '\r'. When it comes to binary files however, we do not have any
+ * line ending meaning with bytes like '\n' and '\r' so sending such 
+ * files without replacement to an unix client will have the client
+ * remove the '\r' so the binary file will be broken. If we replace
+ * '\r' with '\r\0', it will only remove the '\0'.
+ */
+void read_to_buffer(server_info* server, client_value* client, block_slot* slot, uint64_t block)
+{
+    uint16_t block_number = wire_block_number(block);
+    slot->payload_size = 0;
+    if (client->zero_copy)
+    {
+        // Payload is sent from the mapped file or its netascii form as it
+        // is, the header from the table of them
+        slot->data = data_headers[block_number];
+        uint64_t left = client->source_size - client->offset;
+        slot->payload = client->source + client->offset;
+        slot->payload_size = left < client->block_size ? left : client->block_size;
+        slot->size = 4;
+        client->offset += slot->payload_size;
+    }
+    else
+    {
+        // add opcode and block number to buffer, it may have held an OACK
+        slot->data[0] = 0;
+        slot->data[1] = DATA;
+        slot->data[2] = (block_number >> 8);
+        slot->data[3] = block_number;
+
+        // Read from the file rather than its mapping. A file cut short 
+        // while it is sent, as by cp over it, then gives a short block
+        // that ends the transfer instead of SIGBUS on the mapping.
+        uint64_t left = client->source_size - client->offset;
+        size_t wanted = left < client->block_size ? left : client->block_size;
+        char* raw = client->md == netascii ? server->scratch : slot->data + 4;
+        ssize_t got = pread(client->fd, raw, wanted, client->offset);
+        if (ERROR(got))
+        {
+            got = 0;
+        }
+        if (client->md == octet)
+        {
+            slot->size = 4 + got;
+            client->offset += got;
+            return;
+        }
+
+        // It would be possible to have to replace 1 char with 2 when
+        // there is only one char left on the buffer which would require
+        // us to distribute the two replacement characters over two packets.
+        // That's why we store a temp char variable for all clients. When
+        // -1, there is not temp char stored.
+        size_t consumed;
+        slot->size = 4 + netascii_convert(raw, got, &consumed, 
+            slot->data + 4, client->block_size, &client->temp_char);
+        client->offset += consumed;
+    }
+}
+
+/*
+ * Fill the table of DATA headers. Blocks sent from a mapping point at
+ * these, so a header never changes while the kernel may still be 
+ * sending it.
+ */
+void init_data_headers(void)
+{
+    for (uint32_t i = 0; i < 65536; i++)
+    {
+        data_headers[i][0] = 0;
+        data_headers[i][1] = DATA;
+        data_headers[i][2] = i >> 8;
+        data_headers[i][3] = i;
+    }
+}
+
+/*
+ * Make sure the next block of the client's source is in memory, so
+ * reading it does not stall the event loop on the disk. Once less than
+ * half of READ_AHEAD is left ahead of the transfer, the next READ_AHEAD
+ * bytes are handed to io_uring or a reader thread to be faulted in,
+ * unless they are in the page cache already. Returns false if the block
+ * has to wait for a read, the window is sent on once it is done.
+ */
+bool read_ahead(server_info* server, client_value* client)
+{
+    uint64_t needed = client->offset + client->block_size;
+    if (needed > client->source_size)
+    {
+        needed = client->source_size;
+    }
+
+    if (client->reading == 0 && client->resident < client->source_size &&
+        client->resident - client->offset < READ_AHEAD / 2)
+    {
+        uint64_t end = client->resident + READ_AHEAD;
+        if (end > client->source_size)
+        {
+            end = client->source_size;
+        }
+
+        // With -r 0, or if no read can be started, the event loop reads
+        if (server->config->readers == 0 || 
+            is_resident(client->source + client->resident, end - client->resident) ||
+            !start_read(server, client, end))
+        {
+            client->resident = end;
+        }
+    }
+
+    return needed <= client->resident;
+}
+
+/*
+ * Whether every page of data is in memory.
+ */
+bool is_resident(const char* data, uint64_t size)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(page - 1);
+    uintptr_t end = (uintptr_t)data + size;
+
+    // A byte per page, a megabyte or so at a time
+    unsigned char pages[256];
+    while (start < end)
+    {
+        size_t size = end - start < 256 * page ? end - start : 256 * page;
+        if (ERROR(mincore((void*)start, size, pages)))
+        {
+            return false;
+        }
+        for (size_t i = 0; i < (size + page - 1) / page; i++)
+        {
+            if (!(pages[i] & 1))
+            {
+                return false;
+            }
+        }
+        start += size;
+    }
+    return true;
+}
+
+/*
+ * Have the client's source from resident up to end faulted in by the
+ * worker's io_uring or a reader thread. Pages are faulted in with 
+ * MADV_POPULATE_READ, blocks are sent from the mapping so there is no
+ * buffer to read into. Returns false if the read could not be started.
+ */
+bool start_read(server_info* server, client_value* client, uint64_t end)
+{
+    // madvise wants the range to start on a page
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    char* start = (char*)((uintptr_t)(client->source + client->resident) & ~(page - 1));
+    size_t size = client->source + end - start;
+
+    if (server->ring.fd >= 0)
+    {
+        struct io_uring_sqe request;
+        memset(&request, 0, sizeof(request));
+        request.opcode = IORING_OP_MADVISE;
+        request.fd = -1;
+        request.addr = (uintptr_t)start;
+        request.len = size;
+        request.fadvise_advice = MADV_POPULATE_READ;
+        request.user_data = (uintptr_t)client | READ_IO;
+        if (!submit_ring(server, &request))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        read_job* job = (read_job*)malloc(sizeof(read_job));
+        if (job == NULL)
+        {
+            return false;
+        }
+        job->next = NULL;
+        job->server = server;
+        job->client = client;
+        job->kind = READ_IO;
+        job->start = start;
+        job->size = size;
+        queue_job(server->readers, job);
+    }
+
+    client->reading = end;
+    server->reads_in_flight++;
+    server->ranges_read++;
+    return true;
+}
+
+/*
+ * Hand a request to the worker's io_uring. Returns false if it can not 
+ * be taken, with the ring full or a completion for every request in 
+ * flight already.
+ */
+bool submit_ring(server_info* server, const struct io_uring_sqe* request)
+{
+    // Completions must not overflow the ring
+    read_ring* ring = &server->ring;
+    uint32_t tail = *ring->sq_tail;
+    if (server->reads_in_flight + server->writes_in_flight >= ring->cq_entries ||
+        tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+    {
+        return false;
+    }
+
+    uint32_t index = tail & ring->sq_mask;
+    memcpy(&ring->sqes[index], request, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    // Nothing is submitted if this fails, so we take it back
+    if (ERROR(syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0)))
+    {
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Add a job to the end of the reader threads' queue and wake one.
+ */
+void queue_job(reader_pool* pool, read_job* job)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL)
+    {
+        pool->tail->next = job;
+    }
+    else
+    {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Set up reading ahead for a worker. It gets an io_uring of its own if
+ * the kernel allows it, otherwise start_server gives it the reader
+ * threads. Either way it is told through the reads_done eventfd when 
+ * reads are done. Nothing with -r 0.
+ */
+void init_reads(server_info* server)
+{
+    server->ring.fd = -1;
+    server->readers = NULL;
+    server->done = NULL;
+    server->reads_in_flight = 0;
+    server->writes_in_flight = 0;
+    server->ranges_read = 0;
+    server->read_stalls = 0;
+    server->chunks_written = 0;
+    server->write_stalls = 0;
+    server->reads_done.type = READ_EVENT;
+    server->reads_done.fd = -1;
+    if (server->config->readers == 0)
+    {
+        return;
+    }
+
+    server->reads_done.fd = eventfd(0, EFD_NONBLOCK);
+    if (ERROR(server->reads_done.fd))
+    {
+        exit_error("Failed to create read event!\n");
+    }
+    if (pthread_mutex_init(&server->done_lock, NULL) != 0)
+    {
+        exit_error("Failed to create read lock!\n");
+    }
+    watch_event_source(server, &server->reads_done, EPOLLIN | EPOLLET);
+
+    if (server->config->read_ring)
+    {
+        init_ring(&server->ring, server->slab.capacity, server->reads_done.fd);
+    }
+}
+
+/*
+ * Set up an io_uring with room for a completion from each of capacity
+ * transfers, up to what the kernel allows, that signals event_fd. 
+ * Returns false, with fd -1, if there is no io_uring or it can not 
+ * madvise and write, which needs Linux 5.6, or madvise can not populate,
+ * which needs 5.14. A read ahead the ring can only start, and not wait 
+ * for, would be taken as done and fault in the event loop after all.
+ */
+bool init_ring(read_ring* ring, uint32_t capacity, int32_t event_fd)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = capacity < RING_ENTRIES ? RING_ENTRIES : capacity;
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ERROR(ring->fd))
+    {
+        ring->fd = -1;
+        return false;
+    }
+
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, 
+        sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    bool usable = probe != NULL &&
+        !ERROR(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST)) &&
+        probe->last_op >= IORING_OP_MADVISE && (probe->ops[IORING_OP_MADVISE].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED) && can_populate_read();
+    free(probe);
+
+    // The rings are shared with the kernel
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (!usable || ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED ||
+        ERROR(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1)))
+    {
+        destroy_ring(ring);
+        return false;
+    }
+
+    char* sq = (char*)ring->sq_ring;
+    char* cq = (char*)ring->cq_ring;
+    ring->sq_head = (uint32_t*)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    ring->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (uint32_t*)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cq_entries = params.cq_entries;
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+/*
+ * Whether the kernel knows MADV_POPULATE_READ, tried once on a page of
+ * our own. Older kernels refuse the advice with EINVAL.
+ */
+bool can_populate_read(void)
+{
+    static int32_t known = -1;
+    if (known < 0)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        void* area = mmap(NULL, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        known = area != MAP_FAILED && !ERROR(madvise(area, page, MADV_POPULATE_READ));
+        if (area != MAP_FAILED)
+        {
+            munmap(area, page);
+        }
+    }
+    return known;
+}
+
+/*
+ * Unmap and close an io_uring, if there is one.
+ */
+void destroy_ring(read_ring* ring)
+{
+    if (ring->fd < 0)
+    {
+        return;
+    }
+    if (ring->sq_ring != MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring != MAP_FAILED)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/*
+ * Start count reader threads, shared by the workers without an io_uring.
+ */
+void init_readers(reader_pool* pool, uint32_t count)
+{
+    if (pthread_mutex_init(&pool->lock, NULL) != 0 || pthread_cond_init(&pool->wake, NULL) != 0)
+    {
+        exit_error("Failed to create reader lock!\n");
+    }
+    pool->head = pool->tail = NULL;
+    pool->stopping = false;
+    pool->count = count;
+    pool->threads = (pthread_t*)calloc(count, sizeof(pthread_t));
+    if (pool->threads == NULL)
+    {
+        exit_error("Failed to allocate readers!\n");
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, run_reader, pool) != 0)
+        {
+            exit_error("Failed to start reader!\n");
+        }
+    }
+}
+
+/*
+ * Stop the reader threads. The workers have waited for their reads, so
+ * the queue is empty.
+ */
+void stop_readers(reader_pool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/*
+ * Reader thread. Faults in the ranges queued by the workers and writes
+ * the chunks of their uploads, so it is this thread that waits for the
+ * disk, and hands each back to its worker.
+ */
+void* run_reader(void* arg)
+{
+    reader_pool* pool = (reader_pool*)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (pool->head == NULL && !pool->stopping)
+        {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        read_job* job = pool->head;
+        if (job == NULL)
+        {
+            break;
+        }
+        pool->head = job->next;
+        if (pool->head == NULL)
+        {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        // Nothing waits for a conversion, so it is not handed back
+        if (job->kind == CONVERT_IO)
+        {
+            convert_file(job->file);
+            free(job);
+            pthread_mutex_lock(&pool->lock);
+            continue;
+        }
+
+        // Kernels before 5.14 can only be asked to start reading
+        if (job->kind != READ_IO)
+        {
+            job->result = run_upload_io(job->fd, job->kind, job->start, job->size, job->offset);
+        }
+        else if (ERROR(madvise(job->start, job->size, MADV_POPULATE_READ)) && errno == EINVAL)
+        {
+            madvise(job->start, job->size, MADV_WILLNEED);
+        }
+
+        server_info* server = job->server;
+        pthread_mutex_lock(&server->done_lock);
+        job->next = server->done;
+        server->done = job;
+        pthread_mutex_unlock(&server->done_lock);
+        uint64_t one = 1;
+        if (ERROR(write(server->reads_done.fd, &one, sizeof(one))))
+        {
+            // Can only fail if the count overflows, the worker is awake then
+        }
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Start the log thread. Records go into a ring of LOG_ENTRIES, written
+ * out by the thread, so a worker never waits for stdout.
+ */
+void init_log(log_ring* log, log_level level)
+{
+    log->records = (log_record*)calloc(LOG_ENTRIES, sizeof(log_record));
+    log->wake = eventfd(0, 0);
+    if (log->records == NULL || ERROR(log->wake))
+    {
+        exit_error("Failed to create log!\n");
+    }
+    for (uint64_t i = 0; i < LOG_ENTRIES; i++)
+    {
+        log->records[i].sequence = i;
+    }
+    log->mask = LOG_ENTRIES - 1;
+    log->head = log->tail = 0;
+    log->written = log->dropped = 0;
+    log->level = level;
+    log->stopping = false;
+    if (pthread_create(&log->thread, NULL, run_log, log) != 0)
+    {
+        exit_error("Failed to start log thread!\n");
+    }
+}
+
+/*
+ * Stop the log thread once it has written out every record. Called
+ * after the workers have stopped, so no more come in.
+ */
+void stop_log(log_ring* log)
+{
+    uint64_t one = 1;
+    __atomic_store_n(&log->stopping, true, __ATOMIC_RELEASE);
+    if (ERROR(write(log->wake, &one, sizeof(one))))
+    {
+        // It still sees the flag within LOG_INTERVAL
+    }
+    pthread_join(log->thread, NULL);
+    close(log->wake);
+    free(log->records);
+    log->records = NULL;
+}
+
+/*
+ * Log thread. Copies the records that are ready out of the ring and 
+ * writes them with one write per LOG_BUFFER, then sleeps for a while if
+ * there were none. Records dropped since last time are logged as well.
+ */
+void* run_log(void* arg)
+{
+    log_ring* log = (log_ring*)arg;
+    char* buffer = (char*)malloc(LOG_BUFFER);
+    if (buffer == NULL)
+    {
+        exit_error("Failed to allocate log buffer!\n");
+    }
+
+    uint64_t reported = 0;
+    while (true)
+    {
+        bool stopping = __atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE);
+        size_t used = 0;
+        while (true)
+        {
+            log_record* record = &log->records[log->tail & log->mask];
+            if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != log->tail + 1)
+            {
+                break;
+            }
+            if (used + record->size > LOG_BUFFER)
+            {
+                write_all(STDOUT_FILENO, buffer, used);
+                used = 0;
+            }
+            memcpy(buffer + used, record->line, record->size);
+            used += record->size;
+
+            // Free for the worker that claims the position a lap later
+            __atomic_store_n(&record->sequence, log->tail + log->mask + 1, __ATOMIC_RELEASE);
+            log->tail++;
+            log->written++;
+        }
+
+        uint64_t dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+        if (dropped != reported)
+        {
+            if (used + LOG_LINE > LOG_BUFFER)
+            {
+                write_all(STDOUT_FILENO, buffer, used);
+                used = 0;
+            }
+            used += log_prefix(buffer + used, WARN_LEVEL);
+            used += sprintf(buffer + used, "event=log_dropped records=%" PRIu64 "\n", dropped - reported);
+            reported = dropped;
+        }
+        write_all(STDOUT_FILENO, buffer, used);
+
+        if (stopping)
+        {
+            break;
+        }
+        if (used == 0)
+        {
+            struct pollfd wake = { log->wake, POLLIN, 0 };
+            poll(&wake, 1, LOG_INTERVAL);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Whether records of the level are kept, to skip formatting their
+ * fields when they are not.
+ */
+bool logging(log_level level)
+{
+    return server_log.records != NULL && level >= server_log.level;
+}
+
+/*
+ * Add a record of key=value pairs to the log, after its time and level.
+ * The ring is shared by the workers without a lock. A worker claims the
+ * next position by moving head past it, fills in the record and then
+ * marks it written for the log thread. If the log thread has fallen a
+ * whole ring behind, the record is dropped and counted instead of the
+ * worker waiting for it.
+ */
+void log_event(log_level level, const char* format, ...)
+{
+    log_ring* log = &server_log;
+    if (!logging(level))
+    {
+        return;
+    }
+
+    log_record* record;
+    uint64_t position = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+    while (true)
+    {
+        record = &log->records[position & log->mask];
+        int64_t lap = (int64_t)(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lap == 0)
+        {
+            // On failure position is what another worker moved head to
+            if (__atomic_compare_exchange_n(&log->head, &position, position + 1, true, 
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (lap < 0)
+        {
+            __atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            position = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    size_t size = log_prefix(record->line, level);
+    va_list args;
+    va_start(args, format);
+    int32_t n = vsnprintf(record->line + size, LOG_LINE - size, format, args);
+    va_end(args);
+    size = n < 0 ? size : size + n;
+    if (size > LOG_LINE - 1)
+    {
+        size = LOG_LINE - 1;
+    }
+    record->line[size++] = '\n';
+    record->size = (uint32_t)size;
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the time and level that start a record to line. Returns its size.
+ */
+size_t log_prefix(char* line, log_level level)
+{
+    struct timespec now;
+    struct tm utc;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &utc);
+    size_t size = strftime(line, LOG_LINE, "time=%Y-%m-%dT%H:%M:%S", &utc);
+    return size + sprintf(line + size, ".%03ldZ level=%s ", now.tv_nsec / 1000000, log_levels[level]);
+}
+
+/*
+ * Write all of data to fd, unless it fails. Only used by the log and
+ * metrics threads, which may wait for it.
+ */
+void write_all(int32_t fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, data, size);
+        if (ERROR(n))
+        {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+/*
+ * Report how many records were written and dropped, for sizing the ring.
+ */
+void print_log_stats(log_ring* log)
+{
+    fprintf(stdout, "Log: %" PRIu64 " records written, %" PRIu64 " dropped\n", log->written, log->dropped);
+    fflush(stdout);
+}
+
+/*
+ * Bucket of a value in a histogram. Values below HISTOGRAM_SUB have a
+ * bucket each, above that every power of two is split into HISTOGRAM_SUB
+ * buckets, so a bucket is never wider than an eighth of its values.
+ */
+uint32_t histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB)
+    {
+        return (uint32_t)value;
+    }
+    uint32_t exponent = 63 - __builtin_clzll(value);
+    uint32_t sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + sub;
+}
+
+/*
+ * Largest value that goes in the bucket.
+ */
+uint64_t bucket_limit(uint32_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB)
+    {
+        return bucket;
+    }
+    uint32_t shift = bucket / HISTOGRAM_SUB - 1;
+    uint64_t lower = (uint64_t)(HISTOGRAM_SUB + bucket % HISTOGRAM_SUB) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * Add a value to a histogram of one worker. Only that worker writes it,
+ * so it is a few plain adds, see METRIC_ADD.
+ */
+void record_value(histogram* h, uint64_t value)
+{
+    METRIC_ADD(h->counts[histogram_bucket(value)], 1);
+    METRIC_ADD(h->sum, value);
+    METRIC_ADD(h->total, 1);
+}
+
+/*
+ * Time a round trip, from sending the client's timed block to an ACK of
+ * it or a later block. Only one block at a time is timed, and not one
+ * that was sent again, since its ACK may be for either send (Karn's
+ * rule). In an upload it is our ACK that is timed, to the next block.
+ */
+void time_ack(server_info* server, client_value* client, uint64_t acked)
+{
+    if (client->timed_block != 0 && acked >= client->timed_block)
+    {
+        uint64_t rtt = server->now_us - client->timed_at;
+        record_value(&server->metrics.ack_rtt, rtt);
+        client->timed_block = 0;
+        estimate_timeout(server->config, client, rtt);
+    }
+}
+
+/*
+ * Take a round trip into the client's smoothed round trip and its 
+ * variation, and set its timeout from them as in RFC 6298, within the
+ * bounds of -e. That ends any backing off, see back_off. The variation
+ * is at least the millisecond of the timer wheel.
+ */
+void estimate_timeout(const server_config* config, client_value* client, uint64_t rtt)
+{
+    rtt = rtt > 0 ? rtt : 1;
+    if (client->srtt == 0)
+    {
+        client->srtt = rtt;
+        client->rttvar = rtt / 2;
+    }
+    else
+    {
+        uint64_t error = client->srtt > rtt ? client->srtt - rtt : rtt - client->srtt;
+        client->rttvar = (3 * client->rttvar + error) / 4;
+        client->srtt = (7 * client->srtt + rtt) / 8;
+    }
 
-        ip_message(client_key, false);
-        
-        return TRUE;
+    if (!client->fixed_timeout)
+    {
+        uint64_t variation = 4 * client->rttvar > 1000 ? 4 * client->rttvar : 1000;
+        client->timeout = bound_timeout(config, (client->srtt + variation + 999) / 1000);
     }
-    return FALSE;
 }
 
 /*
- * Hashing for clients.
+ * The client's deadline passed, so its timeout is doubled up to the
+ * bound of -e until a round trip is timed again.
  */
-guint client_hash(const void* key)
+void back_off(const server_config* config, client_value* client)
 {
-    sockaddr_in* k = (sockaddr_in*)key;
-    return 41 * k->sin_port + 47 * k->sin_addr.s_addr;
+    if (!client->fixed_timeout)
+    {
+        client->timeout = bound_timeout(config, 2 * client->timeout);
+    }
 }
 
 /*
- * Equal comparison for clients.
+ * Milliseconds within the bounds of -e.
  */
-gboolean client_equals(const void* lhs, const void* rhs)
+uint64_t bound_timeout(const server_config* config, uint64_t timeout)
 {
-    sockaddr_in* a = (sockaddr_in*)lhs;
-    sockaddr_in* b = (sockaddr_in*)rhs;
-    return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    if (timeout < config->min_timeout)
+    {
+        return config->min_timeout;
+    }
+    return timeout > config->max_timeout ? config->max_timeout : timeout;
 }
 
 /*
- * Memory deallocator for hash map's value which 
- * also handles closing file descriptor. 
+ * Start the metrics thread. It writes the metrics of all workers to 
+ * stdout on SIGUSR1 and to anyone who connects to the unix socket at 
+ * path, if there is one.
  */
-void destroy_value(gpointer data) 
+void init_metrics(metrics_reporter* reporter, server_info* servers, uint32_t count, const char* path)
 {
-    client_value* cv = (client_value*)data;
-    if (cv->file_fd != NULL)
+    reporter->servers = servers;
+    reporter->count = count;
+    reporter->listen_fd = -1;
+
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    reporter->signal_fd = signalfd(-1, &usr1, SFD_CLOEXEC);
+    reporter->wake = eventfd(0, EFD_CLOEXEC);
+    if (ERROR(reporter->signal_fd) || ERROR(reporter->wake))
+    {
+        exit_error("Failed to create metrics events!\n");
+    }
+
+    if (path != NULL)
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(address.sun_path))
+        {
+            exit_error("Invalid metrics socket path!\n");
+        }
+        strcpy(address.sun_path, path);
+
+        // A socket left behind by an earlier run is replaced
+        unlink(path);
+        reporter->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (ERROR(reporter->listen_fd) ||
+            ERROR(bind(reporter->listen_fd, (sockaddr*)&address, (socklen_t)sizeof(address))) ||
+            ERROR(listen(reporter->listen_fd, 8)))
+        {
+            exit_error("Failed to open metrics socket!\n");
+        }
+    }
+
+    if (pthread_create(&reporter->thread, NULL, run_metrics, reporter) != 0)
     {
-        fclose(cv->file_fd);
+        exit_error("Failed to start metrics thread!\n");
     }
-    free(cv);
 }
 
 /*
- * Read packet from socket.
+ * Stop the metrics thread and remove its socket.
  */
-void socket_listener(server_info* server)
+void stop_metrics(metrics_reporter* reporter, const char* path)
 {
-    socklen_t len = (socklen_t)sizeof(sockaddr_in);
-    ssize_t n = recvfrom(server->fd, server->input, sizeof(server->input)-1, 
-        0, (sockaddr*)&server->received_from, &len);
-    
-    if (ERROR(n))
+    uint64_t one = 1;
+    if (ERROR(write(reporter->wake, &one, sizeof(one))))
     {
-        exit_error("Failure in receiving a message!\n");
+        exit_error("Failed to stop metrics thread!\n");
+    }
+    pthread_join(reporter->thread, NULL);
+    close(reporter->wake);
+    close(reporter->signal_fd);
+    if (reporter->listen_fd >= 0)
+    {
+        close(reporter->listen_fd);
+        unlink(path);
     }
-    
-    server->input[n] = 0;
 }
 
 /*
- * Send error package to address in received_from in server. Uses
- * predefined error packages with predefined error messages.
+ * Metrics thread. Sleeps until SIGUSR1 comes, someone connects or the
+ * thread is stopped. Writing to a slow reader only holds up this thread.
  */
-void send_error(server_info* server, error_code err)
+void* run_metrics(void* arg)
 {
-    fprintf(stdout, "Sending error: %s\n", error_packs[err].message);
-    fflush(stdout);
+    metrics_reporter* reporter = (metrics_reporter*)arg;
+    struct pollfd ready[3] = 
+    {
+        { reporter->wake, POLLIN, 0 },
+        { reporter->signal_fd, POLLIN, 0 },
+        { reporter->listen_fd, POLLIN, 0 }      // ignored by poll if -1
+    };
 
-    if (ERROR(sendto(server->fd, (void*)&error_packs[err], error_packs[err].size, 
-        0, (sockaddr*)&server->received_from, sizeof(sockaddr_in))))
+    while (true)
     {
-        exit_error("Send failed\n");
+        if (ERROR(poll(ready, 3, -1)))
+        {
+            if (errno == EINTR) continue;
+            exit_error("Metrics poll failed\n");
+        }
+        if (ready[0].revents)
+        {
+            break;
+        }
+        if (ready[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(reporter->signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                write_metrics(reporter, STDOUT_FILENO);
+            }
+        }
+        if (ready[2].revents & POLLIN)
+        {
+            int32_t fd = accept4(reporter->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (!ERROR(fd))
+            {
+                write_metrics(reporter, fd);
+                close(fd);
+            }
+        }
     }
+    return NULL;
 }
 
 /*
- * Handling of RRQ requests. If valid, client is added to pool.
+ * Write the metrics of all workers to fd in the Prometheus text format.
+ * Workers keep updating them meanwhile, so each value is read once 
+ * with an atomic load and the dump is not a snapshot of one moment.
  */
-void start_new_transfer(GHashTable* clients, server_info* server, char* root)
+void write_metrics(metrics_reporter* reporter, int32_t fd)
 {
-    // If a client resends a read request in a middle of a transfer
-    if (g_hash_table_contains(clients, &server->received_from))
+    worker_metrics total;
+    memset(&total, 0, sizeof(total));
+    uint64_t active = 0;
+    for (uint32_t i = 0; i < reporter->count; i++)
     {
-        //fprintf(stdout, "DEBUG: Double RRQ from client\n"); fflush(stdout);
-
-        client_value* client = (client_value*)g_hash_table_lookup(clients, &server->received_from);
-
-        // If client is not on first data package, we terminate his transfer since
-        // he should not be sending RRQ at this point. If at first package, we allow
-        // resends of first package.
-        if (client->block_number != 1)
+        worker_metrics* m = &reporter->servers[i].metrics;
+        total.requests += __atomic_load_n(&m->requests, __ATOMIC_RELAXED);
+        total.retransmits += __atomic_load_n(&m->retransmits, __ATOMIC_RELAXED);
+        total.timeouts += __atomic_load_n(&m->timeouts, __ATOMIC_RELAXED);
+        total.bytes_sent += __atomic_load_n(&m->bytes_sent, __ATOMIC_RELAXED);
+        total.uploads += __atomic_load_n(&m->uploads, __ATOMIC_RELAXED);
+        total.bytes_received += __atomic_load_n(&m->bytes_received, __ATOMIC_RELAXED);
+        total.bytes_written += __atomic_load_n(&m->bytes_written, __ATOMIC_RELAXED);
+        total.single_blocks += __atomic_load_n(&m->single_blocks, __ATOMIC_RELAXED);
+        total.stray_acks += __atomic_load_n(&m->stray_acks, __ATOMIC_RELAXED);
+        for (uint32_t r = 0; r < 4; r++)
         {
-            //fprintf(stdout, "DEBUG: RRQ in mid transfer\n"); fflush(stdout);
-
-            send_error(server, ILLEGAL_OP);
-            g_hash_table_remove(clients, &server->received_from);
+            total.ended[r] += __atomic_load_n(&m->ended[r], __ATOMIC_RELAXED);
         }
-        else
+        for (uint32_t e = 0; e < 8; e++)
         {
-            // On too many resends, we stop resending and send one error before
-            // terminating. Otherwise we resend the first package.
-            if (client->resends++ == MAX_RESENDS)
-            {
-                //fprintf(stdout, "DEBUG: Removing after constant RRQ\n"); fflush(stdout);
-
-                send_error(server, UNDEFINED);
-                g_hash_table_remove(clients, &server->received_from);
-            }
-            else
+            total.errors[e] += __atomic_load_n(&m->errors[e], __ATOMIC_RELAXED);
+        }
+        histogram* from[] = { &m->duration, &m->first_block, &m->ack_rtt, &m->upload_duration, &m->write_time, &m->srtt };
+        histogram* to[] = { &total.duration, &total.first_block, &total.ack_rtt, &total.upload_duration, &total.write_time, &total.srtt };
+        for (uint32_t h = 0; h < 6; h++)
+        {
+            for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++)
             {
-                //fprintf(stdout, "DEBUG: Resending after double RRQ\n"); fflush(stdout);
-
-                if (ERROR(sendto(server->fd, client->buffer, client->buffer_size, 
-                    0, (sockaddr*)&server->received_from, sizeof(sockaddr_in))))
-                {
-                    exit_error("Send failed\n");
-                }
+                to[h]->counts[b] += __atomic_load_n(&from[h]->counts[b], __ATOMIC_RELAXED);
             }
+            to[h]->sum += __atomic_load_n(&from[h]->sum, __ATOMIC_RELAXED);
+            to[h]->total += __atomic_load_n(&from[h]->total, __ATOMIC_RELAXED);
         }
-        return;
+        active += __atomic_load_n(&reporter->servers[i].slab.used, __ATOMIC_RELAXED);
     }
 
-    // Show client in server's stdout
-    ip_message(&server->received_from, true);
+    // The cache is shared by the workers
+    file_cache* cache = reporter->servers[0].cache;
+    uint64_t cache_hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    uint64_t cache_misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    uint64_t cache_evictions = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+    uint64_t cache_conversions = __atomic_load_n(&cache->conversions, __ATOMIC_RELAXED);
+    uint64_t cache_bytes = __atomic_load_n(&cache->used, __ATOMIC_RELAXED);
 
-    // Construct full path. 0 is returned if path contains parent directory access.
-    char full_path[512];
-    size_t size = construct_full_path(full_path, root, server->input + 2);
-    if (!size)
+    char* text = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&text, &size);
+    if (out == NULL)
     {
-        //fprintf(stdout, "DEBUG: Client wanted to access parent directory\n"); fflush(stdout);
-        send_error(server, ACCESS_VIOLATION);
         return;
     }
-
-    fprintf(stdout, "PATH: %s\n", full_path);
-
-    //fprintf(stdout, "DEBUG: File asked for is %s\n", full_path); fflush(stdout);
-
-    // Allocate memory for a new client
-    client_value* new_client = init_client(get_mode(server->input + size + 3));
-    switch(new_client->md)
+    fprintf(out, "# HELP tftpd_requests_total Read requests received.\n");
+    fprintf(out, "# TYPE tftpd_requests_total counter\n");
+    fprintf(out, "tftpd_requests_total %" PRIu64 "\n", total.requests);
+    fprintf(out, "# HELP tftpd_single_block_requests_total Read requests for files of one block answered without a transfer.\n");
+    fprintf(out, "# TYPE tftpd_single_block_requests_total counter\n");
+    fprintf(out, "tftpd_single_block_requests_total %" PRIu64 "\n", total.single_blocks);
+    fprintf(out, "# HELP tftpd_single_block_stray_acks_total ACKs of block 1 from clients with no transfer that no single block was sent to.\n");
+    fprintf(out, "# TYPE tftpd_single_block_stray_acks_total counter\n");
+    fprintf(out, "tftpd_single_block_stray_acks_total %" PRIu64 "\n", total.stray_acks);
+    fprintf(out, "# HELP tftpd_transfers_total Transfers that ended, by how.\n");
+    fprintf(out, "# TYPE tftpd_transfers_total counter\n");
+    for (uint32_t r = 0; r < 4; r++)
     {
-        case netascii:
-            fprintf(stdout, "Mode: NETASCII\n");
-            new_client->file_fd = fopen(full_path, "r");
-            break;
-        case octet:
-            fprintf(stdout, "Mode: OCTET\n");
-            new_client->file_fd = fopen(full_path, "rb");
-            break;
-        default:
-            fprintf(stdout, "Mode: Not Supported\n");
-            send_error(server, ILLEGAL_OP);
-            return;
+        fprintf(out, "tftpd_transfers_total{result=\"%s\"} %" PRIu64 "\n", transfer_results[r], total.ended[r]);
     }
-
-    // If file was not found, we tell the client
-    if (new_client->file_fd == NULL)
+    fprintf(out, "# HELP tftpd_errors_sent_total Error packets sent, by TFTP error code.\n");
+    fprintf(out, "# TYPE tftpd_errors_sent_total counter\n");
+    for (uint32_t e = 0; e < 8; e++)
     {
-        //fprintf(stdout, "DEBUG: File does not exists\n"); fflush(stdout);
-        send_error(server, NO_FILE);
-        free(new_client);
-        return;
+        fprintf(out, "tftpd_errors_sent_total{code=\"%u\"} %" PRIu64 "\n", e, total.errors[e]);
     }
+    fprintf(out, "# HELP tftpd_retransmits_total DATA blocks sent again.\n");
+    fprintf(out, "# TYPE tftpd_retransmits_total counter\n");
+    fprintf(out, "tftpd_retransmits_total %" PRIu64 "\n", total.retransmits);
+    fprintf(out, "# HELP tftpd_timeouts_total Windows sent again because no ACK came in time.\n");
+    fprintf(out, "# TYPE tftpd_timeouts_total counter\n");
+    fprintf(out, "tftpd_timeouts_total %" PRIu64 "\n", total.timeouts);
+    fprintf(out, "# HELP tftpd_sent_bytes_total Payload bytes of DATA blocks sent.\n");
+    fprintf(out, "# TYPE tftpd_sent_bytes_total counter\n");
+    fprintf(out, "tftpd_sent_bytes_total %" PRIu64 "\n", total.bytes_sent);
+    fprintf(out, "# HELP tftpd_upload_requests_total Write requests received.\n");
+    fprintf(out, "# TYPE tftpd_upload_requests_total counter\n");
+    fprintf(out, "tftpd_upload_requests_total %" PRIu64 "\n", total.uploads);
+    fprintf(out, "# HELP tftpd_received_bytes_total Payload bytes of DATA blocks taken in uploads.\n");
+    fprintf(out, "# TYPE tftpd_received_bytes_total counter\n");
+    fprintf(out, "tftpd_received_bytes_total %" PRIu64 "\n", total.bytes_received);
+    fprintf(out, "# HELP tftpd_written_bytes_total Bytes written to uploaded files.\n");
+    fprintf(out, "# TYPE tftpd_written_bytes_total counter\n");
+    fprintf(out, "tftpd_written_bytes_total %" PRIu64 "\n", total.bytes_written);
+    fprintf(out, "# HELP tftpd_active_transfers Transfers in progress.\n");
+    fprintf(out, "# TYPE tftpd_active_transfers gauge\n");
+    fprintf(out, "tftpd_active_transfers %" PRIu64 "\n", active);
+    fprintf(out, "# HELP tftpd_cache_hits_total Read requests served from a file already cached.\n");
+    fprintf(out, "# TYPE tftpd_cache_hits_total counter\n");
+    fprintf(out, "tftpd_cache_hits_total %" PRIu64 "\n", cache_hits);
+    fprintf(out, "# HELP tftpd_cache_misses_total Read requests for a file that was not cached, or had changed.\n");
+    fprintf(out, "# TYPE tftpd_cache_misses_total counter\n");
+    fprintf(out, "tftpd_cache_misses_total %" PRIu64 "\n", cache_misses);
+    fprintf(out, "# HELP tftpd_cache_evictions_total Files dropped from the cache to keep it within its budget.\n");
+    fprintf(out, "# TYPE tftpd_cache_evictions_total counter\n");
+    fprintf(out, "tftpd_cache_evictions_total %" PRIu64 "\n", cache_evictions);
+    fprintf(out, "# HELP tftpd_cache_conversions_total Netascii forms of cached files built.\n");
+    fprintf(out, "# TYPE tftpd_cache_conversions_total counter\n");
+    fprintf(out, "tftpd_cache_conversions_total %" PRIu64 "\n", cache_conversions);
+    fprintf(out, "# HELP tftpd_cache_bytes Bytes of files and their netascii forms in the cache.\n");
+    fprintf(out, "# TYPE tftpd_cache_bytes gauge\n");
+    fprintf(out, "tftpd_cache_bytes %" PRIu64 "\n", cache_bytes);
+    print_histogram(out, "tftpd_transfer_duration_seconds", "RRQ to the last ACK of finished transfers.", &total.duration);
+    print_histogram(out, "tftpd_first_block_seconds", "RRQ to its first OACK or DATA block being queued.", &total.first_block);
+    print_histogram(out, "tftpd_ack_rtt_seconds", "DATA block to its ACK, or an upload's ACK to the next block.", &total.ack_rtt);
+    print_histogram(out, "tftpd_transfer_srtt_seconds", "Smoothed round trip of each transfer as it ended.", &total.srtt);
+    print_histogram(out, "tftpd_upload_duration_seconds", "WRQ to the uploaded file being in place.", &total.upload_duration);
+    print_histogram(out, "tftpd_write_seconds", "Writes of upload chunks to disk.", &total.write_time);
+    fclose(out);
 
-    //fprintf(stdout, "DEBUG: File does exists\n"); fflush(stdout);
-    fprintf(stdout, "Beginning transfer...\n");
-
-    // Add next 512 bytes of client's file descriptor to a buffer
-    read_to_buffer(new_client);
+    write_all(fd, text, size);
+    free(text);
+}
 
-    //fprintf(stdout, "DEBUG: Ready to send %zu bytes\n", new_client->buffer_size); fflush(stdout);
+/*
+ * Print a histogram as a Prometheus summary. A quantile is the largest
+ * value of the bucket it falls in, 1 is the largest value seen.
+ */
+void print_histogram(FILE* out, const char* name, const char* help, histogram* merged)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    fprintf(out, "# HELP %s %s\n", name, help);
+    fprintf(out, "# TYPE %s summary\n", name);
 
-    // Send first pack
-    if (ERROR(sendto(server->fd, new_client->buffer, new_client->buffer_size, 
-        0, (sockaddr*)&server->received_from, sizeof(sockaddr_in))))
+    uint64_t seen = 0;
+    uint32_t bucket = 0;
+    for (uint32_t q = 0; q < 5; q++)
     {
-        exit_error("Send failed\n");
+        // Rank of the quantile, at least the first value
+        uint64_t rank = (uint64_t)(quantiles[q] * merged->total + 0.5);
+        rank = rank == 0 ? 1 : rank;
+        while (bucket < HISTOGRAM_BUCKETS - 1 && seen + merged->counts[bucket] < rank)
+        {
+            seen += merged->counts[bucket++];
+        }
+        fprintf(out, "%s{quantile=\"%g\"} %.6f\n", name, quantiles[q], 
+            merged->total == 0 ? 0.0 : bucket_limit(bucket) / 1e6);
     }
-
-    // Add client to client pool
-    g_hash_table_insert(clients, sockaddr_cpy(&server->received_from), new_client);
-
-    fflush(stdout);
+    fprintf(out, "%s_sum %.6f\n", name, merged->sum / 1e6);
+    fprintf(out, "%s_count %" PRIu64 "\n", name, merged->total);
 }
 
 /*
- * Create path from root directory and file. File can incldude path as
- * long as it does not contain "..", upon which 0 is returned. Otherwise
- * a positive number is returned. New path is "<root>/<file>\0".
+ * Pick the fastest way to find line breaks that the CPU supports.
  */
-size_t construct_full_path(char* dest, const char* root, const char* file_name)
+void init_netascii(void)
 {
-    if (strstr(file_name, "..") != NULL) 
+    find_line_break = find_line_break_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
     {
-        return 0;
+        find_line_break = find_line_break_avx2;
     }
-
-    // Lengths
-    size_t file_name_size = strlen(file_name);
-    size_t root_size = strlen(root);
-
-    // Constructing new string
-    strncpy(dest, root, root_size);
-    dest[root_size] = '/';
-    strncpy(dest + root_size + 1, file_name, file_name_size);
-    dest[root_size + file_name_size + 1] = '\0';
-
-    //fprintf(stdout, "DEBUG: path = %s\n", dest); fflush(stdout);
-    
-    return file_name_size;
+    else
+    {
+        find_line_break = find_line_break_sse2;
+    }
+#endif
 }
 
 /*
- * Convert string to mode enum.
+ * Convert src to netascii into dest until either runs out. Runs of bytes
+ * without line breaks are copied as they are, each '\n' and '\r' becomes
+ * "\r\n" and "\r\0". If only the first of the two fits, the second is 
+ * kept in carry (-1 if none) and goes first next time. Returns the size
+ * written and sets consumed to the number of bytes read from src.
  */
-int32_t get_mode(char* str)
+size_t netascii_convert(const char* src, size_t src_size, size_t* consumed, char* dest, size_t dest_size, char* carry)
 {
-    size_t len = strlen(str);
+    size_t in = 0;
+    size_t out = 0;
 
-    // Convert mode to upper since all combinations of 
-    // upper and lower case digits should be supported
-    char upper[len + 1];
-    for (size_t i = 0; i < len; i++)
+    // If we owe the buffer a character from last package
+    if (*carry != -1 && dest_size > 0)
     {
-        upper[i] = toupper(str[i]);
+        dest[out++] = *carry;
+        *carry = -1;
     }
-    upper[len] = '\0';
-    //fprintf(stdout, "DEBUG: model = %s\n", upper); fflush(stdout);
 
-    // We only allow 'NETASCII' and 'OCTET'.
-    if (len == 8 && !strncmp("NETASCII", upper, 8))
-    {
-        return netascii;
-    }
-    else if (len == 5 && !strncmp("OCTET", upper, 5))
-    {
-        return octet;
-    }
-    else if (len == 4 && !strncmp("MAIL", upper, 4))
-    {
-        return mail;
-    }
-    else
+    while (in < src_size && out < dest_size)
     {
-        return invalid;
+        size_t room = src_size - in < dest_size - out ? src_size - in : dest_size - out;
+        size_t run = find_line_break(src + in, room);
+        memcpy(dest + out, src + in, run);
+        in += run;
+        out += run;
+        if (run == room)
+        {
+            break;
+        }
+
+        char second = src[in++] == '\n' ? '\n' : '\0';
+        dest[out++] = '\r';
+        if (out == dest_size)
+        {
+            // Special case: no more space on buffer, add in next pack
+            *carry = second;
+        }
+        else
+        {
+            dest[out++] = second;
+        }
     }
+
+    *consumed = in;
+    return out;
 }
 
 /*
- * Print ip and port of client. Either when first contact 
- * is made or when removing from client pool.
+ * Size of data once converted to netascii, every line break becomes two.
  */
-void ip_message(sockaddr_in* client, bool greeting)
+uint64_t netascii_size(const char* data, uint64_t size)
 {
-    char ip_buffer[16];
-    memset(ip_buffer, 0, sizeof(ip_buffer));
-    if (inet_ntop(AF_INET, &(client->sin_addr), ip_buffer, 16) != NULL) 
+    uint64_t converted = size;
+    uint64_t offset = 0;
+    while (offset < size)
     {
-        fprintf(stdout, "%s %s on port %hu...\n", 
-            greeting ? "Request received from" : "Terminating", 
-            ip_buffer, client->sin_port);
+        offset += find_line_break(data + offset, size - offset);
+        if (offset < size)
+        {
+            converted++;
+            offset++;
+        }
     }
+    return converted;
 }
 
 /*
- * Deal with ACK packates for already existing clients.
+ * Convert size bytes of netascii in src back to the server's line 
+ * endings in dest, "\r\n" to "\n" and "\r\0" to "\r". A '\r' at the
+ * end of src is held in carry for the next block, one held from the 
+ * last block comes first. dest must have room for size + 1 bytes. 
+ * Returns the bytes written to dest.
  */
-void continue_existing_transfer(GHashTable* clients, server_info* server)
+size_t netascii_decode(const char* src, size_t size, char* dest, bool* carry)
 {
-    // If client does not exist, he should not be sending ACKs
-    if (!g_hash_table_contains(clients, &server->received_from))
+    size_t counter = 0;
+    size_t offset = 0;
+    if (*carry && size > 0)
     {
-        //fprintf(stdout, "DEBUG: ACK from unknown source\n"); fflush(stdout);
-        send_error(server, UNKNOWN_ID);
-        return;
+        *carry = false;
+        if (src[0] == '\n' || src[0] == '\0')
+        {
+            dest[counter++] = src[0] == '\n' ? '\n' : '\r';
+            offset++;
+        }
+        else
+        {
+            dest[counter++] = '\r';
+        }
     }
 
-    // Byte 2: aaaa-bbbb
-    // Byte 3: cccc-dddd
-    // Block number: aaaa-bbbb-cccc-dddd
-    uint16_t block_number = (unsigned char)server->input[3] + ((unsigned char)(server->input[2]) << 8);
-
-    // Reset last action to current time
-    client_value* client = (client_value*)g_hash_table_lookup(clients, &server->received_from);
-    client->last_action = time(NULL);
-
-    //fprintf(stdout, "DEBUG: BN = (%hu,%hu)%s\n", block_number, client->block_number); fflush(stdout);
-
-    // If block number does not match
-    if (client->block_number != block_number)
+    while (offset < size)
     {
-        //fprintf(stdout, "DEBUG: Block number mismatch\n"); fflush(stdout);
+        // Copy up to the next '\r' as it is
+        const char* found = (const char*)memchr(src + offset, '\r', size - offset);
+        size_t run = found == NULL ? size - offset : (size_t)(found - src) - offset;
+        memcpy(dest + counter, src + offset, run);
+        counter += run;
+        offset += run;
+        if (found == NULL)
+        {
+            break;
+        }
 
-        // Check if too many resends already. If so, send error and remove
-        // client from client pool. Otherwise resend.
-        if (client->resends++ == MAX_RESENDS)
+        if (offset + 1 == size)
         {
-            //fprintf(stdout, "DEBUG: Resends depleted\n"); fflush(stdout);
-            send_error(server, UNDEFINED);
-            g_hash_table_remove(clients, &server->received_from);
+            *carry = true;
+            offset++;
+        }
+        else if (src[offset + 1] == '\n' || src[offset + 1] == '\0')
+        {
+            dest[counter++] = src[offset + 1] == '\n' ? '\n' : '\r';
+            offset += 2;
         }
         else
         {
-            //fprintf(stdout, "DEBUG: Sending last package\n"); fflush(stdout);
-            if (ERROR(sendto(server->fd, client->buffer, client->buffer_size, 
-                0, (sockaddr*)&server->received_from, sizeof(sockaddr_in))))
-            {
-                exit_error("Send failed\n");
-            }
+            dest[counter++] = '\r';
+            offset++;
         }
-        return;
     }
+    return counter;
+}
 
-    // Check if transfer is done and if so, remove client from pool
-    if (client->buffer_size < 516)
+/*
+ * Index of the first '\r' or '\n' in data, size if there is none.
+ */
+size_t find_line_break_scalar(const char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
     {
-        fprintf(stdout, "Transfer done, client removed from pool...\n");
-        fflush(stdout);
-
-        //fprintf(stdout, "DEBUG: Last package confirmed\n"); fflush(stdout);
-        g_hash_table_remove(clients, &server->received_from);
-        return;
+        if (data[i] == '\n' || data[i] == '\r')
+        {
+            return i;
+        }
     }
-    
-    // If block number match, we reset resends
-    client->resends = 0;
-
-    //fprintf(stdout, "DEBUG: BN before = %hu\n", client->block_number); fflush(stdout);
-
-    // Increment block number, circular ignoring 0.
-    client->block_number = (client->block_number == 65535 ? 1 : client->block_number + 1);
-
-    //fprintf(stdout, "DEBUG: BN after = %hu\n", client->block_number); fflush(stdout);
-
-    // Read next 512 byte from client's file descriptor
-    read_to_buffer(client);
-
-    //fprintf(stdout, "DEBUG: Metadata = (%d,%d,%d,%d)\n", client->buffer[0], client->buffer[1], 
-    //             client->buffer[2], client->buffer[3]); fflush(stdout);
-    //fprintf(stdout, "DEBUG: Ready to send %zu bytes\n", client->buffer_size); fflush(stdout);
+    return size;
+}
 
-    // Send next package
-    if (ERROR(sendto(server->fd, client->buffer, client->buffer_size, 
-        0, (sockaddr*)&server->received_from, sizeof(sockaddr_in))))
+#if defined(__x86_64__)
+/*
+ * Same as find_line_break_scalar, 16 bytes at a time. SSE2 is part of 
+ * every x86-64 CPU.
+ */
+size_t find_line_break_sse2(const char* data, size_t size)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
     {
-        exit_error("Send failed\n");
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
     }
-
+    return i + find_line_break_scalar(data + i, size - i);
 }
 
 /*
- * Read file to packet. If mode is netascii we replace '\n' and '\r'
- * with '\r\n' and '\r\n' respectively. Octet is an agreement to send
- * files as is. Netascii however expects windows line endings. Tftp
- * clients will remove '\r' when running on Unix so not replacing '\n'
- * with '\r\n' does not matter but for a windows client, it would miss
- * the '\r'. When it comes to binary files however, we do not have any
- * line ending meaning with bytes like '\n' and '\r' so sending such 
- * files without replacement to an unix client will have the client
- * remove the '\r' so the binary file will be broken. If we replace
- * '\r' with '\r\0', it will only remove the '\0'.
+ * Same as find_line_break_scalar, 32 bytes at a time. Only used if the
+ * CPU has AVX2, see init_netascii.
  */
-void read_to_buffer(client_value* client)
+__attribute__((target("avx2")))
+size_t find_line_break_avx2(const char* data, size_t size)
 {
-    // add block number to buffer
-    client->buffer[2] = (client->block_number >> 8);
-    client->buffer[3] = client->block_number;
-
-    if (client->md == octet)
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
     {
-        // If mode is octed, no need to do anything special
-        client->buffer_size = 4 + fread(client->buffer + 4, 1, 512, client->file_fd);
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(data + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf)));
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
     }
-    else
-    {
-        // It would be possible to have to replace 1 char with 2 when
-        // there is only one char left on the buffer which would require
-        // us to distribute the two replacement characters over two packets.
-        // That's why we store a temp char variable for all clients. When
-        // -1, there is not temp char stored.
 
-        // Acts as an index & counter
-        size_t counter = 0;
-
-        // If we owe the buffer a character from last package
-        if (client->temp_char != -1)
+    // The rest here as well, calling the SSE2 version would mix in 
+    // non-VEX instructions
+    if (i + 16 <= size)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(cr)), _mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(lf))));
+        if (mask != 0)
         {
-            client->buffer[4 + counter++] = client->temp_char;
-            client->temp_char = -1;
+            return i + __builtin_ctz(mask);
         }
-
-        // Max chars read is 512
-        while (counter < 512)
+        i += 16;
+    }
+    for (; i < size; i++)
+    {
+        if (data[i] == '\n' || data[i] == '\r')
         {
-            // Check if fail is already read to end
-            int32_t next = fgetc(client->file_fd);
-            if (next == EOF)
-            {
-                break;
-            }
-
-            char next_char = (char)next;
+            return i;
+        }
+    }
+    return size;
+}
+#else
+/*
+ * No vector versions on other CPUs.
+ */
+size_t find_line_break_sse2(const char* data, size_t size)
+{
+    return find_line_break_scalar(data, size);
+}
 
-            if (next_char == '\n')
-            {
-                // '\n' is replaced with '\r'
-                client->buffer[4 + counter++] = '\r';
+size_t find_line_break_avx2(const char* data, size_t size)
+{
+    return find_line_break_scalar(data, size);
+}
+#endif
 
-                if (counter ==  512)
-                {
-                    // Special case: no more space on buffer, add in next pack
-                    client->temp_char = '\n';
-                }
-                else
-                {
-                    client->buffer[4 + counter++] = '\n';
-                }
-            }
-            else if (next_char == '\r')
-            {
-                client->buffer[4 + counter++] = '\r';
-                if (counter == 512)
-                {
-                    client->temp_char = '\0';
-                }
-                else
-                {
-                    // Special case: no more space, '\0' added next pack
-                    client->buffer[4 + counter++] = '\0';
-                }
-            }
-            else
-            {
-                client->buffer[4 + counter++] = next_char;
-            }   
-        }
+/*
+ * Allocate all of a worker's client values up front, in one block, and
+ * put them in the free list.
+ */
+void init_slab(client_slab* slab, uint32_t capacity)
+{
+    slab->clients = (client_value*)calloc(capacity, sizeof(client_value));
+    slab->buffers = (char*)malloc((size_t)capacity * SLAB_BUFFER);
+    slab->slots = (block_slot*)calloc(capacity, sizeof(block_slot));
+    if (slab->clients == NULL || slab->buffers == NULL || slab->slots == NULL)
+    {
+        exit_error("Failed to allocate clients!\n");
+    }
 
-        // Return size of buffer, including metadata
-        client->buffer_size = 4 + counter;
+    // First ones first, they are the most likely to be in cache
+    slab->free = NULL;
+    for (uint32_t i = capacity; i-- > 0; )
+    {
+        slab->clients[i].link = slab->free;
+        slab->free = &slab->clients[i];
     }
+    slab->capacity = capacity;
+    slab->used = 0;
 }
 
 /*
- * Copy sockaddr_in for hash table.
+ * Free the slab. Its clients must have been freed already.
  */
-sockaddr_in* sockaddr_cpy(sockaddr_in* src)
+void destroy_slab(client_slab* slab)
 {
-    sockaddr_in* copy = (sockaddr_in*)malloc(sizeof(sockaddr_in));
-    memcpy(copy, src, sizeof(sockaddr_in));
-    return copy;
+    free(slab->clients);
+    free(slab->buffers);
+    free(slab->slots);
 }
 
 /*
- * Allocate and init client value for hash table.
+ * Take a client value from the slab and init it for the client pool. 
+ * The slab must not be empty. The window's slots share one buffer,
+ * unless blocks are sent from the mapped file with headers from the
+ * table of them. The OACK goes in slot 0 before any block is read, so
+ * the buffer is never smaller than a default sized block. A buffer and 
+ * window no larger than the default are the client's own in the slab,
+ * only larger ones are allocated. Returns NULL if they can not be, the 
+ * client is then left in the slab.
  */
-client_value* init_client(mode m)
+client_value* init_client(client_slab* slab, const server_config* config, mode m, transfer_options* options, bool zero_copy)
 {
-    client_value* c = (client_value*)malloc(sizeof(client_value));
-    c->file_fd = NULL;
-    c->buffer_size = 516;
-    c->block_number = 1;
+    client_value* c = slab->free;
+    size_t index = c - slab->clients;
+    size_t slot_size = zero_copy ? 0 : 4 + (size_t)options->block_size;
+    size_t buffer_size = slot_size * options->window_size;
+    c->buffer = buffer_size <= SLAB_BUFFER ? slab->buffers + index * SLAB_BUFFER : (char*)malloc(buffer_size);
+    c->window = options->window_size == 1 ? &slab->slots[index] : 
+        (block_slot*)malloc(options->window_size * sizeof(block_slot));
+    if (c->buffer == NULL || c->window == NULL)
+    {
+        if (c->buffer != slab->buffers + index * SLAB_BUFFER)
+        {
+            free(c->buffer);
+        }
+        if (c->window != &slab->slots[index])
+        {
+            free(c->window);
+        }
+        return NULL;
+    }
+    slab->free = c->link;
+    METRIC_ADD(slab->used, 1);
+    for (uint16_t i = 0; i < options->window_size; i++)
+    {
+        c->window[i].data = c->buffer + i * slot_size;
+        c->window[i].size = 0;
+        c->window[i].payload = NULL;
+        c->window[i].payload_size = 0;
+        c->window[i].queued_at = UINT64_MAX;
+    }
+
+    c->file = NULL;
+    c->source = NULL;
+    c->source_size = 0;
+    c->offset = 0;
+    c->block_size = options->block_size;
+    c->window_size = options->window_size;
+    c->base = 1;
+    c->next = 1;
+    c->read = 0;
+    c->last_block = 0;
+    c->rewound_base = UINT64_MAX;
+    c->fixed_timeout = options->has_timeout;
+    c->timeout = c->fixed_timeout ? (uint64_t)options->timeout * 1000 : 
+        bound_timeout(config, INITIAL_TIMEOUT);
+    c->timer.next = c->timer.prev = NULL;
+    c->event.type = TRANSFER_EVENT;
+    c->event.fd = -1;
+    c->link = NULL;
     c->resends = 0;
     c->md = m;
+    c->zero_copy = zero_copy;
+    c->fd = -1;
     c->temp_char = -1;
-    c->last_action = time(NULL);
-    c->buffer[0] = 0;
-    c->buffer[1] = DATA;
+    c->resident = 0;
+    c->reading = 0;
+    c->stalled = false;
+    c->started = 0;
+    c->replied = false;
+    c->timed_block = 0;
+    c->timed_at = 0;
+    c->srtt = 0;
+    c->rttvar = 0;
+    c->upload = NULL;
     return c;
 }
@@ -0,0 +1,160 @@
+// Netascii conversion throughput of the server, the old fgetc loop against
+// netascii_convert with each line break scan. Outputs are checked to match.
+// gcc -std=c11 -D_GNU_SOURCE -O2 -pthread $(pkg-config --cflags glib-2.0) netascii_bench.c
+//     -o netascii_bench -pthread $(pkg-config --libs glib-2.0)
+// ./netascii_bench <file> [block size]
+#define main tftpd_main
+#include "../src/tftpd.c"
+#undef main
+
+#define ROUNDS 20
+
+double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The conversion as it was, one fgetc per byte
+size_t convert_fgetc(FILE* file, char* dest, size_t block_size, char* carry)
+{
+    size_t counter = 0;
+    if (*carry != -1)
+    {
+        dest[counter++] = *carry;
+        *carry = -1;
+    }
+    while (counter < block_size)
+    {
+        int next = fgetc(file);
+        if (next == EOF)
+        {
+            break;
+        }
+        char next_char = (char)next;
+        if (next_char == '\n' || next_char == '\r')
+        {
+            dest[counter++] = '\r';
+            char second = next_char == '\n' ? '\n' : '\0';
+            if (counter == block_size)
+            {
+                *carry = second;
+            }
+            else
+            {
+                dest[counter++] = second;
+            }
+        }
+        else
+        {
+            dest[counter++] = next_char;
+        }
+    }
+    return counter;
+}
+
+// Converts the whole file block by block, returns output size and a
+// checksum of the output if sum is not NULL
+size_t run_fgetc(const char* path, size_t block_size, char* block, uint64_t* sum)
+{
+    FILE* file = fopen(path, "r");
+    char carry = -1;
+    size_t total = 0, n;
+    uint64_t hash = 0;
+    do
+    {
+        n = convert_fgetc(file, block, block_size, &carry);
+        for (size_t i = 0; sum != NULL && i < n; i++)
+        {
+            hash = hash * 31 + (unsigned char)block[i];
+        }
+        total += n;
+    } while (n == block_size);
+    fclose(file);
+    if (sum != NULL)
+    {
+        *sum = hash;
+    }
+    return total;
+}
+
+size_t run_convert(const char* data, size_t size, size_t block_size, char* block, uint64_t* sum)
+{
+    char carry = -1;
+    size_t offset = 0, total = 0, n;
+    uint64_t hash = 0;
+    do
+    {
+        size_t consumed;
+        n = netascii_convert(data + offset, size - offset, &consumed, block, block_size, &carry);
+        offset += consumed;
+        for (size_t i = 0; sum != NULL && i < n; i++)
+        {
+            hash = hash * 31 + (unsigned char)block[i];
+        }
+        total += n;
+    } while (n == block_size);
+    if (sum != NULL)
+    {
+        *sum = hash;
+    }
+    return total;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <file> [block size]\n", argv[0]);
+        return 1;
+    }
+    size_t block_size = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_BLOCK_SIZE;
+    char* block = malloc(block_size);
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0 || file_stat.st_size == 0)
+    {
+        fprintf(stderr, "Can not read %s\n", argv[1]);
+        return 1;
+    }
+    cached_file* file = map_file(fd, &file_stat);
+    close(fd);
+
+    uint64_t want, sum;
+    run_fgetc(argv[1], block_size, block, &want);
+    double start = seconds();
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        run_fgetc(argv[1], block_size, block, NULL);
+    }
+    double elapsed = seconds() - start;
+    fprintf(stdout, "%-8s %8.1f MB/s\n", "fgetc", ROUNDS * file->size / elapsed / 1e6);
+
+    const char* names[] = { "scalar", "sse2", "avx2" };
+    size_t (*scans[])(const char*, size_t) = { find_line_break_scalar, find_line_break_sse2, find_line_break_avx2 };
+    for (int s = 0; s < 3; s++)
+    {
+#if defined(__x86_64__)
+        if (s == 2 && !__builtin_cpu_supports("avx2"))
+        {
+            continue;
+        }
+#endif
+        find_line_break = scans[s];
+        run_convert(file->data, file->size, block_size, block, &sum);
+        start = seconds();
+        for (int i = 0; i < ROUNDS; i++)
+        {
+            run_convert(file->data, file->size, block_size, block, NULL);
+        }
+        elapsed = seconds() - start;
+        fprintf(stdout, "%-8s %8.1f MB/s%s\n", names[s], ROUNDS * file->size / elapsed / 1e6,
+            sum == want ? "" : "  OUTPUT DIFFERS");
+    }
+
+    free_file(file);
+    free(block);
+    return 0;
+}
@@ -0,0 +1,298 @@
+// Latency seen by clients of small files while another client reads a
+// file from a slow disk. The slow file is put in the server's file cache
+// with its mapping replaced by memory that a userfaultfd thread fills a
+// page at a time after a delay, like a disk that takes DELAY_MS per page.
+// Run as root or with vm.unprivileged_userfaultfd set.
+// gcc -std=c11 -D_GNU_SOURCE -O2 -pthread $(pkg-config --cflags glib-2.0) slow_read_bench.c
+//     -o slow_read_bench -pthread $(pkg-config --libs glib-2.0)
+// ./slow_read_bench <loop|ring|threads>
+#define main tftpd_main
+#include "../src/tftpd.c"
+#undef main
+
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+
+#define PORT "36969"
+#define DELAY_MS 2
+#define DURATION 3.0
+#define FAST_CLIENTS 8
+#define FAST_SIZE (64 * 1024)
+#define SLOW_SIZE (16 << 20)
+#define MAX_SAMPLES (1 << 22)
+
+typedef struct
+{
+    int32_t fd;
+    char* page;
+    size_t page_size;
+    volatile bool running;
+} slow_disk;
+
+typedef struct
+{
+    int32_t fd;
+    char last[INPUT_SIZE];      // last packet sent, resent if no answer
+    size_t last_size;
+    double sent_at;
+    bool first;                 // waiting for the first block, latency not counted
+} bench_client;
+
+double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void* lhs, const void* rhs)
+{
+    double a = *(const double*)lhs, b = *(const double*)rhs;
+    return (a > b) - (a < b);
+}
+
+// Answers page faults in the slow file, each after DELAY_MS
+void* run_slow_disk(void* arg)
+{
+    slow_disk* disk = (slow_disk*)arg;
+    while (disk->running)
+    {
+        struct pollfd ready = { disk->fd, POLLIN, 0 };
+        if (poll(&ready, 1, 10) <= 0)
+        {
+            continue;
+        }
+        struct uffd_msg msg;
+        if (read(disk->fd, &msg, sizeof(msg)) != sizeof(msg) || msg.event != UFFD_EVENT_PAGEFAULT)
+        {
+            continue;
+        }
+        struct timespec delay = { 0, DELAY_MS * 1000000L };
+        nanosleep(&delay, NULL);
+
+        struct uffdio_copy copy;
+        copy.dst = msg.arg.pagefault.address & ~(disk->page_size - 1);
+        copy.src = (uintptr_t)disk->page;
+        copy.len = disk->page_size;
+        copy.mode = 0;
+        ioctl(disk->fd, UFFDIO_COPY, &copy);
+    }
+    return NULL;
+}
+
+void send_packet(bench_client* client, sockaddr_in* to, const char* data, size_t size)
+{
+    memcpy(client->last, data, size);
+    client->last_size = size;
+    client->sent_at = seconds();
+    sendto(client->fd, data, size, 0, (sockaddr*)to, sizeof(sockaddr_in));
+}
+
+void send_request(bench_client* client, sockaddr_in* to, const char* name, const char* options, size_t options_size)
+{
+    char packet[INPUT_SIZE];
+    packet[0] = 0;
+    packet[1] = RRQ;
+    size_t size = 2 + sprintf(packet + 2, "%s", name) + 1;
+    size += sprintf(packet + size, "octet") + 1;
+    memcpy(packet + size, options, options_size);
+    client->first = true;
+    send_packet(client, to, packet, size + options_size);
+}
+
+int main(int argc, char** argv)
+{
+    const char* mode = argc > 1 ? argv[1] : "ring";
+    if (strcmp(mode, "loop") && strcmp(mode, "ring") && strcmp(mode, "threads"))
+    {
+        fprintf(stderr, "Usage: %s <loop|ring|threads>\n", argv[0]);
+        return 1;
+    }
+
+    // A small file in the page cache and a large one on the slow disk
+    char root[] = "/tmp/slow_read_XXXXXX";
+    if (mkdtemp(root) == NULL)
+    {
+        exit_error("mkdtemp");
+    }
+    char fast_path[64], slow_path[64];
+    sprintf(fast_path, "%s/fast", root);
+    sprintf(slow_path, "%s/slow", root);
+    FILE* fast = fopen(fast_path, "w");
+    for (int i = 0; i < FAST_SIZE; i++)
+    {
+        fputc(rand() & 0xff, fast);
+    }
+    fclose(fast);
+    int32_t slow_fd = open(slow_path, O_RDWR | O_CREAT, 0644);
+    if (ERROR(slow_fd) || ERROR(ftruncate(slow_fd, SLOW_SIZE)))
+    {
+        exit_error("slow file");
+    }
+
+    server_config config;
+    config.port = PORT;
+    config.root = root;
+    config.batch_size = DEFAULT_BATCH_SIZE;
+    config.workers = 1;
+    config.transfer_sockets = false;
+    config.cache_size = (uint64_t)DEFAULT_CACHE_SIZE << 20;
+    config.max_transfers = 64;
+    config.readers = strcmp(mode, "loop") ? DEFAULT_READERS : 0;
+    config.read_ring = !strcmp(mode, "ring");
+    config.uploads = false;
+
+    shutdown_fd = eventfd(0, EFD_NONBLOCK);
+    init_netascii();
+    init_data_headers();
+    file_cache cache;
+    init_cache(&cache, root, config.cache_size);
+    server_info* server = (server_info*)calloc(1, sizeof(server_info));
+    server->config = &config;
+    server->cache = &cache;
+    init_server(config.port, server);
+    reader_pool readers;
+    if (config.readers > 0 && server->ring.fd < 0)
+    {
+        if (config.read_ring)
+        {
+            fprintf(stderr, "No io_uring\n");
+            return 1;
+        }
+        init_readers(&readers, config.readers);
+        server->readers = &readers;
+    }
+
+    // Swap the slow file's mapping for one the slow disk fills
+    struct stat file_stat;
+    fstat(slow_fd, &file_stat);
+    cached_file* slow = acquire_file(&cache, "slow", slow_fd, &file_stat);
+    munmap(slow->data, slow->size);
+    slow->data = (char*)mmap(NULL, slow->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    slow_disk disk;
+    disk.page_size = sysconf(_SC_PAGESIZE);
+    disk.page = (char*)malloc(disk.page_size);
+    memset(disk.page, 'x', disk.page_size);
+    disk.running = true;
+    disk.fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+    struct uffdio_register region;
+    region.range.start = (uintptr_t)slow->data;
+    region.range.len = slow->size;
+    region.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ERROR(disk.fd) || ERROR(ioctl(disk.fd, UFFDIO_API, &api)) || ERROR(ioctl(disk.fd, UFFDIO_REGISTER, &region)))
+    {
+        exit_error("userfaultfd");
+    }
+    pthread_t disk_thread;
+    pthread_create(&disk_thread, NULL, run_slow_disk, &disk);
+    pthread_create(&server->thread, NULL, run_worker, server);
+
+    sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(convert_port(PORT));
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // Client 0 reads the slow file with large blocks, the rest read the
+    // small one over and over
+    bench_client clients[FAST_CLIENTS + 1];
+    struct pollfd polls[FAST_CLIENTS + 1];
+    for (int i = 0; i <= FAST_CLIENTS; i++)
+    {
+        clients[i].fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        polls[i].fd = clients[i].fd;
+        polls[i].events = POLLIN;
+    }
+    const char blksize[] = "blksize\0" "1428";
+    send_request(&clients[0], &to, "slow", blksize, sizeof(blksize));
+    for (int i = 1; i <= FAST_CLIENTS; i++)
+    {
+        send_request(&clients[i], &to, "fast", NULL, 0);
+    }
+
+    double* samples = (double*)malloc(MAX_SAMPLES * sizeof(double));
+    uint32_t count = 0, fast_done = 0;
+    uint64_t slow_bytes = 0;
+    double end = seconds() + DURATION;
+    while (seconds() < end)
+    {
+        if (poll(polls, FAST_CLIENTS + 1, 100) < 0)
+        {
+            break;
+        }
+        double now = seconds();
+        for (int i = 0; i <= FAST_CLIENTS; i++)
+        {
+            bench_client* client = &clients[i];
+            char packet[2048];
+            ssize_t size;
+            while ((size = recv(client->fd, packet, sizeof(packet), 0)) >= 4)
+            {
+                if (packet[1] != DATA && packet[1] != OACK)
+                {
+                    continue;
+                }
+                if (i == 0)
+                {
+                    slow_bytes += packet[1] == DATA ? size - 4 : 0;
+                }
+                else if (!client->first && count < MAX_SAMPLES)
+                {
+                    samples[count++] = now - client->sent_at;
+                }
+
+                char ack[4] = { 0, ACK, packet[1] == DATA ? packet[2] : 0, packet[1] == DATA ? packet[3] : 0 };
+                client->first = false;
+                send_packet(client, &to, ack, 4);
+                if (i > 0 && packet[1] == DATA && size < 4 + DEFAULT_BLOCK_SIZE)
+                {
+                    fast_done++;
+                    send_request(client, &to, "fast", NULL, 0);
+                }
+            }
+
+            // Nothing lost on loopback, but just in case
+            if (now - client->sent_at > 1.0)
+            {
+                client->first = true;
+                send_packet(client, &to, client->last, client->last_size);
+            }
+        }
+    }
+
+    server_loop = false;
+    uint64_t one = 1;
+    if (ERROR(write(shutdown_fd, &one, sizeof(one))))
+    {
+        exit_error("shutdown");
+    }
+    pthread_join(server->thread, NULL);
+    disk.running = false;
+    pthread_join(disk_thread, NULL);
+    if (config.readers > 0 && server->ring.fd < 0)
+    {
+        stop_readers(&readers);
+    }
+
+    qsort(samples, count, sizeof(double), compare_doubles);
+    fprintf(stdout, "%-8s %u small files, slow file at %.1f MB/s\n", mode, fast_done, slow_bytes / DURATION / 1e6);
+    if (count > 0)
+    {
+        fprintf(stdout, "%-8s ACK to DATA: p50 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us\n", mode,
+            samples[count / 2] * 1e6, samples[count * 99 / 100] * 1e6,
+            samples[count * 999 / 1000] * 1e6, samples[count - 1] * 1e6);
+    }
+
+    release_file(slow);
+    close_server(server);
+    destroy_cache(&cache);
+    close(slow_fd);
+    unlink(fast_path);
+    unlink(slow_path);
+    rmdir(root);
+    free(samples);
+    free(disk.page);
+    free(server);
+    return 0;
+}
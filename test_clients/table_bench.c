@@ -0,0 +1,123 @@
+// Lookup cost of the server's client table against the GHashTable it
+// replaced, with the old hash, at a number of live transfers. Clients
+// are on one subnet with consecutive ports, as in a network boot.
+// gcc -std=c11 -D_GNU_SOURCE -O2 -pthread $(pkg-config --cflags glib-2.0) table_bench.c
+//     -o table_bench -pthread $(pkg-config --libs glib-2.0)
+// ./table_bench [live transfers]
+#define main tftpd_main
+#include "../src/tftpd.c"
+#undef main
+
+#define LOOKUPS 20000000
+
+double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The old hashing for clients
+guint old_client_hash(const void* key)
+{
+    sockaddr_in* k = (sockaddr_in*)key;
+    return 41 * k->sin_port + 47 * k->sin_addr.s_addr;
+}
+
+gboolean old_client_equals(const void* lhs, const void* rhs)
+{
+    sockaddr_in* a = (sockaddr_in*)lhs;
+    sockaddr_in* b = (sockaddr_in*)rhs;
+    return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t live = argc > 1 ? strtoul(argv[1], NULL, 0) : 16384;
+
+    // Clients 10.0.x.y, each with a few transfers on consecutive ports
+    client_slab slab;
+    init_slab(&slab, live);
+    for (uint32_t i = 0; i < live; i++)
+    {
+        client_value* client = &slab.clients[i];
+        memset(&client->address, 0, sizeof(sockaddr_in));
+        client->address.sin_family = AF_INET;
+        client->address.sin_addr.s_addr = htonl(0x0a000000 | (i / 4));
+        client->address.sin_port = htons(49152 + i % 4);
+    }
+
+    // Lookups in a random order, packets from all clients interleave
+    uint32_t* order = malloc(LOOKUPS * sizeof(uint32_t));
+    srand(1);
+    for (uint32_t i = 0; i < LOOKUPS; i++)
+    {
+        order[i] = (uint32_t)rand() % live;
+    }
+
+    // The old way, contains and then lookup for every ACK
+    GHashTable* old_table = g_hash_table_new_full(old_client_hash, old_client_equals, free, NULL);
+    for (uint32_t i = 0; i < live; i++)
+    {
+        sockaddr_in* key = malloc(sizeof(sockaddr_in));
+        memcpy(key, &slab.clients[i].address, sizeof(sockaddr_in));
+        g_hash_table_insert(old_table, key, &slab.clients[i]);
+    }
+    uint64_t found = 0;
+    double start = seconds();
+    for (uint32_t i = 0; i < LOOKUPS; i++)
+    {
+        sockaddr_in* address = &slab.clients[order[i]].address;
+        if (g_hash_table_contains(old_table, address))
+        {
+            found += g_hash_table_lookup(old_table, address) != NULL;
+        }
+    }
+    double elapsed = seconds() - start;
+    fprintf(stdout, "GHashTable, contains + lookup  %6.1f ns/lookup (%lu found)\n",
+        elapsed * 1e9 / LOOKUPS, (unsigned long)found);
+
+    found = 0;
+    start = seconds();
+    for (uint32_t i = 0; i < LOOKUPS; i++)
+    {
+        found += g_hash_table_lookup(old_table, &slab.clients[order[i]].address) != NULL;
+    }
+    elapsed = seconds() - start;
+    fprintf(stdout, "GHashTable, lookup             %6.1f ns/lookup (%lu found)\n",
+        elapsed * 1e9 / LOOKUPS, (unsigned long)found);
+    g_hash_table_destroy(old_table);
+
+    // The new table, one probe sequence per ACK
+    client_table table;
+    init_table(&table, live);
+    for (uint32_t i = 0; i < live; i++)
+    {
+        insert_client(&table, find_client_slot(&table, &slab.clients[i].address), &slab.clients[i]);
+    }
+    found = 0;
+    start = seconds();
+    for (uint32_t i = 0; i < LOOKUPS; i++)
+    {
+        found += lookup_client(&table, &slab.clients[order[i]].address) != NULL;
+    }
+    elapsed = seconds() - start;
+    fprintf(stdout, "client_table, lookup           %6.1f ns/lookup (%lu found)\n",
+        elapsed * 1e9 / LOOKUPS, (unsigned long)found);
+
+    // Average probe length, 1 is a hit on the first slot
+    uint64_t probes = 0;
+    for (uint32_t i = 0; i < live; i++)
+    {
+        uint32_t home = hash_address(&slab.clients[i].address) & table.mask;
+        uint32_t at = find_client_slot(&table, &slab.clients[i].address) - table.slots;
+        probes += ((at - home) & table.mask) + 1;
+    }
+    fprintf(stdout, "client_table, %u slots for %u transfers, %.2f probes per lookup\n",
+        table.mask + 1, live, (double)probes / live);
+
+    destroy_table(&table);
+    destroy_slab(&slab);
+    free(order);
+    return 0;
+}
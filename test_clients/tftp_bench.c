@@ -0,0 +1,813 @@
+// Load generator for the server. Keeps many read requests in flight at
+// once, each from a socket of its own, speaking TFTP itself, and reports
+// transfers per second, MB/s and latency percentiles. Blocks can be lost
+// or reordered on the way in and ACKs lost on the way out, on purpose.
+// make -C src tftp_bench
+// ./src/tftp_bench [-a address] [-b blksize] [-c concurrency] [-d seconds] [-f file]...
+//     [-l loss %] [-m mode] [-n transfers] [-o reorder %] [-p root] [-r retries]
+//     [-t timeout ms] [-T server timeout s] [-w windowsize] [-z size]... <port>
+// Files given with -z are written to the root given with -p as bench_<size>
+// before the run and removed after it. Given the root, the bytes received
+// are checked against the size of each file.
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERROR(x) ((x) < 0)
+
+#define RRQ 1
+#define DATA 3
+#define ACK 4
+#define ERR 5
+#define OACK 6
+
+#define MAX_PACKET 65536
+#define MAX_FILES 64
+#define EVENTS 256
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_CONCURRENCY 64
+#define DEFAULT_TRANSFERS 10000
+#define DEFAULT_TIMEOUT_MS 200
+#define DEFAULT_RETRIES 25
+#define DEFAULT_SERVER_TIMEOUT 1
+#define DALLY_SOCKETS 16384     // finished sockets kept open at most
+
+typedef struct sockaddr_in sockaddr_in;
+typedef struct sockaddr sockaddr;
+
+typedef struct
+{
+    char name[256];
+    uint64_t size[2];           // octet and netascii bytes, 0 if not known
+    bool created;               // written by us, removed at the end
+} bench_file;
+
+typedef struct
+{
+    int32_t fd;                 // -1 when idle
+    bench_file* file;
+    sockaddr_in peer;           // the server's port until it answers, then the transfer's
+    bool answered;
+    uint16_t block_size;
+    uint16_t window_size;
+    uint64_t expected;          // next block wanted, counted past 65535
+    uint16_t in_window;         // blocks taken since the last ACK
+    uint64_t bytes;
+    double started;
+    double first_block;         // when the first block came, 0 before
+    double sent_at;
+    uint32_t retries;
+    char last[MAX_PACKET];      // last packet sent, resent on timeouts
+    size_t last_size;
+    char held[MAX_PACKET];      // a block held back to arrive after the next one
+    ssize_t held_size;
+} bench_client;
+
+typedef struct
+{
+    uint64_t done;
+    uint64_t errors;
+    uint64_t gave_up;
+    uint64_t wrong_size;
+    uint64_t bytes;
+    uint64_t received;
+    uint64_t dropped;
+    uint64_t reordered;
+    uint64_t acks_dropped;
+    uint64_t timeouts;
+    uint64_t last_acks;         // last ACKs sent again to a block resent after the end
+    double* durations;
+    double* first_blocks;
+    uint64_t samples;
+    uint64_t capacity;
+} bench_stats;
+
+typedef struct
+{
+    sockaddr_in server;
+    const char* root;
+    const char* mode;
+    bool netascii;
+    uint32_t block_size;        // 0 to not ask for one
+    uint32_t window_size;       // 0 to not ask for one
+    uint32_t server_timeout;    // seconds before the server resends, 0 to not ask
+    uint32_t concurrency;
+    uint64_t transfers;         // 0 when running for a duration
+    double duration;
+    double loss;                // chance of dropping a block or an ACK
+    double reorder;             // chance of holding a block back
+    double timeout;
+    double dally;               // seconds a finished transfer's socket stays open
+    uint32_t retries;
+    bench_file files[MAX_FILES];
+    uint32_t file_count;
+} bench_config;
+
+typedef struct
+{
+    int32_t fd;
+    double until;               // closed after
+    sockaddr_in peer;
+    char ack[4];                // the last ACK, sent again if the server resends
+    bool done;                  // failed transfers only take what comes
+} dally_socket;
+
+typedef struct
+{
+    dally_socket sockets[DALLY_SOCKETS]; // oldest first from head
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;          // at most DALLY_SOCKETS, less if few files may be open
+    int32_t epoll_fd;           // the main one, finished sockets leave it
+    int32_t sockets_fd;         // of the sockets, itself in the main epoll
+} dally_queue;
+
+uint64_t random_state = 0x9e3779b97f4a7c15;
+dally_queue dallying;
+
+double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void* lhs, const void* rhs)
+{
+    double a = *(const double*)lhs, b = *(const double*)rhs;
+    return (a > b) - (a < b);
+}
+
+void exit_error(const char* msg)
+{
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+// xorshift64*, a fixed sequence so runs with loss can be repeated
+double next_random(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (double)((random_state * 0x2545f4914f6cdd1dULL) >> 11) / (double)(1ULL << 53);
+}
+
+bool chance(double percent)
+{
+    return percent > 0 && next_random() * 100.0 < percent;
+}
+
+// Block numbers as the server puts them on the wire, wrapping past 0
+uint16_t wire_block_number(uint64_t block)
+{
+    return block == 0 ? 0 : (uint16_t)((block - 1) % 65535 + 1);
+}
+
+// Sizes of a file as octet and netascii, where each \n and \r takes two bytes
+void measure_file(const char* root, bench_file* file)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, file->name);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+    {
+        exit_error(path);
+    }
+    char buffer[65536];
+    size_t n;
+    uint64_t size = 0, breaks = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    {
+        size += n;
+        for (size_t i = 0; i < n; i++)
+        {
+            breaks += buffer[i] == '\n' || buffer[i] == '\r';
+        }
+    }
+    fclose(f);
+    file->size[0] = size;
+    file->size[1] = size + breaks;
+}
+
+// Writes root/bench_<size> with random bytes
+void create_file(const char* root, bench_file* file, uint64_t size)
+{
+    snprintf(file->name, sizeof(file->name), "bench_%" PRIu64, size);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", root, file->name);
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+    {
+        exit_error(path);
+    }
+    char buffer[65536];
+    while (size > 0)
+    {
+        size_t n = size < sizeof(buffer) ? size : sizeof(buffer);
+        for (size_t i = 0; i < n; i++)
+        {
+            buffer[i] = (char)(next_random() * 256);
+        }
+        fwrite(buffer, 1, n, f);
+        size -= n;
+    }
+    fclose(f);
+    file->created = true;
+}
+
+void send_packet(bench_client* client, const char* data, size_t size)
+{
+    memcpy(client->last, data, size);
+    client->last_size = size;
+    sendto(client->fd, data, size, 0, (sockaddr*)&client->peer, sizeof(sockaddr_in));
+}
+
+// Sends an ACK for a block, unless it is lost on purpose. The last one
+// never is, nothing would resend it once the transfer is counted.
+void send_ack(bench_config* config, bench_stats* stats, bench_client* client, uint16_t block, bool last)
+{
+    char ack[4] = { 0, ACK, (char)(block >> 8), (char)block };
+    memcpy(client->last, ack, sizeof(ack));
+    client->last_size = sizeof(ack);
+    if (!last && chance(config->loss))
+    {
+        stats->acks_dropped++;
+        return;
+    }
+    sendto(client->fd, ack, sizeof(ack), 0, (sockaddr*)&client->peer, sizeof(sockaddr_in));
+}
+
+// Opens a socket for the next transfer and sends its request
+void start_transfer(bench_config* config, bench_client* client, uint64_t index, int32_t epoll_fd)
+{
+    client->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ERROR(client->fd))
+    {
+        exit_error("socket");
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    if (ERROR(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event)))
+    {
+        exit_error("epoll_ctl");
+    }
+
+    client->file = &config->files[index % config->file_count];
+    client->peer = config->server;
+    client->answered = false;
+    client->block_size = DEFAULT_BLOCK_SIZE;
+    client->window_size = 1;
+    client->expected = 1;
+    client->in_window = 0;
+    client->bytes = 0;
+    client->retries = 0;
+    client->held_size = 0;
+    client->started = client->sent_at = seconds();
+    client->first_block = 0;
+
+    char packet[1024];
+    packet[0] = 0;
+    packet[1] = RRQ;
+    size_t size = 2;
+    size += sprintf(packet + size, "%s", client->file->name) + 1;
+    size += sprintf(packet + size, "%s", config->mode) + 1;
+    if (config->block_size > 0)
+    {
+        size += sprintf(packet + size, "blksize") + 1;
+        size += sprintf(packet + size, "%u", config->block_size) + 1;
+    }
+    if (config->window_size > 0)
+    {
+        size += sprintf(packet + size, "windowsize") + 1;
+        size += sprintf(packet + size, "%u", config->window_size) + 1;
+    }
+    if (config->server_timeout > 0)
+    {
+        size += sprintf(packet + size, "timeout") + 1;
+        size += sprintf(packet + size, "%u", config->server_timeout) + 1;
+    }
+    send_packet(client, packet, size);
+}
+
+// Closes finished sockets whose time is up, or the oldest early if
+// there is no room for another
+void close_dallying(double now, bool room)
+{
+    while (dallying.count > 0 && (dallying.sockets[dallying.head].until <= now
+        || (room && dallying.count == dallying.capacity)))
+    {
+        close(dallying.sockets[dallying.head].fd);
+        dallying.head = (dallying.head + 1) % DALLY_SOCKETS;
+        dallying.count--;
+    }
+}
+
+// Answers blocks the server resent to finished transfers with their last
+// ACK again, the first one was lost, most often by a full socket buffer
+void read_dallying(bench_stats* stats)
+{
+    static char packet[MAX_PACKET];
+    struct epoll_event events[EVENTS];
+    int32_t n = epoll_wait(dallying.sockets_fd, events, EVENTS, 0);
+    for (int32_t i = 0; i < n; i++)
+    {
+        dally_socket* socket = &dallying.sockets[events[i].data.u32];
+        sockaddr_in from;
+        socklen_t length = sizeof(from);
+        ssize_t size;
+        bool resent = false;
+        while ((size = recvfrom(socket->fd, packet, sizeof(packet), 0, (sockaddr*)&from, &length)) >= 0)
+        {
+            if (socket->done && !resent && size >= 4 && packet[1] == DATA && !memcmp(packet + 2, socket->ack + 2, 2)
+                && from.sin_port == socket->peer.sin_port)
+            {
+                sendto(socket->fd, socket->ack, sizeof(socket->ack), 0, (sockaddr*)&socket->peer, sizeof(sockaddr_in));
+                stats->last_acks++;
+                resent = true;
+            }
+            length = sizeof(from);
+        }
+    }
+}
+
+// Keeps the transfer's socket open for a while, as RFC 1350 has the
+// side sending the last ACK dally, and counts the transfer. Should the
+// last ACK be lost the server resends its block and is answered, rather
+// than holding on to the transfer until a later one gets the same port.
+void finish_transfer(bench_config* config, bench_stats* stats, bench_client* client, uint64_t* failed, double now)
+{
+    epoll_ctl(dallying.epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close_dallying(now, true);
+    if (dallying.capacity == 0)
+    {
+        close(client->fd);
+    }
+    else
+    {
+        uint32_t tail = (dallying.head + dallying.count++) % DALLY_SOCKETS;
+        dally_socket* socket = &dallying.sockets[tail];
+        socket->fd = client->fd;
+        socket->until = now + config->dally;
+        socket->peer = client->peer;
+        memcpy(socket->ack, client->last, sizeof(socket->ack));
+        socket->done = failed == NULL;
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = tail;
+        epoll_ctl(dallying.sockets_fd, EPOLL_CTL_ADD, socket->fd, &event);
+    }
+    client->fd = -1;
+    if (failed != NULL)
+    {
+        (*failed)++;
+        return;
+    }
+
+    uint64_t want = client->file->size[config->netascii];
+    if (want != 0 && want != client->bytes)
+    {
+        stats->wrong_size++;
+        return;
+    }
+    stats->done++;
+    stats->bytes += client->bytes;
+    if (stats->samples == stats->capacity)
+    {
+        stats->capacity = stats->capacity == 0 ? 4096 : stats->capacity * 2;
+        stats->durations = (double*)realloc(stats->durations, stats->capacity * sizeof(double));
+        stats->first_blocks = (double*)realloc(stats->first_blocks, stats->capacity * sizeof(double));
+    }
+    stats->durations[stats->samples] = now - client->started;
+    stats->first_blocks[stats->samples] = client->first_block - client->started;
+    stats->samples++;
+}
+
+// Reads the options the server accepted
+void read_oack(bench_client* client, const char* packet, ssize_t size)
+{
+    const char* at = packet + 2;
+    const char* end = packet + size;
+    while (at < end)
+    {
+        const char* value = memchr(at, '\0', end - at);
+        if (value == NULL || ++value >= end || memchr(value, '\0', end - value) == NULL)
+        {
+            break;
+        }
+        if (!strcasecmp(at, "blksize"))
+        {
+            client->block_size = (uint16_t)strtoul(value, NULL, 10);
+        }
+        else if (!strcasecmp(at, "windowsize"))
+        {
+            client->window_size = (uint16_t)strtoul(value, NULL, 10);
+        }
+        at = value + strlen(value) + 1;
+    }
+}
+
+// Takes one packet for a transfer, returns false once the transfer is over
+bool handle_packet(bench_config* config, bench_stats* stats, bench_client* client,
+    const char* packet, ssize_t size, double now)
+{
+    if (size < 4)
+    {
+        return true;
+    }
+    uint16_t opcode = (uint8_t)packet[0] << 8 | (uint8_t)packet[1];
+    client->sent_at = now;
+    client->retries = 0;
+
+    if (opcode == ERR)
+    {
+        finish_transfer(config, stats, client, &stats->errors, now);
+        return false;
+    }
+    if (opcode == OACK)
+    {
+        // Resent while our ACK 0 was lost, the options are the same
+        if (client->expected == 1)
+        {
+            read_oack(client, packet, size);
+            send_ack(config, stats, client, 0, false);
+        }
+        return true;
+    }
+    if (opcode != DATA)
+    {
+        return true;
+    }
+
+    uint16_t block = (uint8_t)packet[2] << 8 | (uint8_t)packet[3];
+    if (block != wire_block_number(client->expected))
+    {
+        // Lost or reordered, take the server back to the last block in order
+        send_ack(config, stats, client, wire_block_number(client->expected - 1), false);
+        client->in_window = 0;
+        return true;
+    }
+
+    uint64_t bytes = size - 4;
+    if (client->first_block == 0)
+    {
+        client->first_block = now;
+    }
+    client->bytes += bytes;
+    client->expected++;
+    client->in_window++;
+    if (bytes < client->block_size)
+    {
+        send_ack(config, stats, client, block, true);
+        finish_transfer(config, stats, client, NULL, now);
+        return false;
+    }
+    if (client->in_window >= client->window_size)
+    {
+        send_ack(config, stats, client, block, false);
+        client->in_window = 0;
+    }
+    return true;
+}
+
+// Reads everything waiting on a transfer's socket, dropping and holding
+// back blocks by chance
+void read_packets(bench_config* config, bench_stats* stats, bench_client* client, double now)
+{
+    static char packet[MAX_PACKET];
+    while (client->fd >= 0)
+    {
+        sockaddr_in from;
+        socklen_t length = sizeof(from);
+        ssize_t size = recvfrom(client->fd, packet, sizeof(packet), 0, (sockaddr*)&from, &length);
+        if (ERROR(size))
+        {
+            return;
+        }
+        stats->received++;
+
+        // The first answer may come from a new port, the transfer's TID
+        if (!client->answered)
+        {
+            client->peer = from;
+            client->answered = true;
+        }
+        else if (from.sin_port != client->peer.sin_port || from.sin_addr.s_addr != client->peer.sin_addr.s_addr)
+        {
+            continue;
+        }
+
+        if (size >= 2 && packet[1] == DATA)
+        {
+            if (chance(config->loss))
+            {
+                stats->dropped++;
+                continue;
+            }
+            if (client->held_size == 0 && chance(config->reorder))
+            {
+                memcpy(client->held, packet, size);
+                client->held_size = size;
+                stats->reordered++;
+                continue;
+            }
+        }
+        if (!handle_packet(config, stats, client, packet, size, now))
+        {
+            return;
+        }
+        if (client->held_size > 0)
+        {
+            ssize_t held = client->held_size;
+            client->held_size = 0;
+            if (!handle_packet(config, stats, client, client->held, held, now))
+            {
+                return;
+            }
+        }
+    }
+}
+
+// Resends the last packet of transfers that heard nothing for a while,
+// and gives up on them after too many tries
+void check_timeouts(bench_config* config, bench_stats* stats, bench_client* clients, double now)
+{
+    for (uint32_t i = 0; i < config->concurrency; i++)
+    {
+        bench_client* client = &clients[i];
+        if (client->fd < 0 || now - client->sent_at < config->timeout)
+        {
+            continue;
+        }
+        if (client->held_size > 0)
+        {
+            ssize_t held = client->held_size;
+            client->held_size = 0;
+            handle_packet(config, stats, client, client->held, held, now);
+            continue;
+        }
+        stats->timeouts++;
+        if (++client->retries > config->retries)
+        {
+            finish_transfer(config, stats, client, &stats->gave_up, now);
+            continue;
+        }
+        client->sent_at = now;
+        sendto(client->fd, client->last, client->last_size, 0, (sockaddr*)&client->peer, sizeof(sockaddr_in));
+    }
+}
+
+void print_percentiles(const char* name, double* samples, uint64_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+    fprintf(stdout, "%-12s p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms  p99.9 %9.3f ms  max %9.3f ms\n", name,
+        samples[count / 2] * 1e3, samples[count * 90 / 100] * 1e3, samples[count * 99 / 100] * 1e3,
+        samples[count * 999 / 1000] * 1e3, samples[count - 1] * 1e3);
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-a address] [-b blksize] [-c concurrency] [-d seconds] [-f file]...\n"
+        "    [-l loss %%] [-m mode] [-n transfers] [-o reorder %%] [-p root] [-r retries]\n"
+        "    [-t timeout ms] [-T server timeout s] [-w windowsize] [-z size]... <port>\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    bench_config config;
+    memset(&config, 0, sizeof(config));
+    config.server.sin_family = AF_INET;
+    config.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    config.mode = "octet";
+    config.concurrency = DEFAULT_CONCURRENCY;
+    config.transfers = DEFAULT_TRANSFERS;
+    config.timeout = DEFAULT_TIMEOUT_MS / 1e3;
+    config.retries = DEFAULT_RETRIES;
+    config.server_timeout = DEFAULT_SERVER_TIMEOUT;
+    uint64_t sizes[MAX_FILES];
+    uint32_t size_count = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:c:d:f:l:m:n:o:p:r:t:T:w:z:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                if (inet_pton(AF_INET, optarg, &config.server.sin_addr) != 1)
+                {
+                    usage(argv[0]);
+                }
+                break;
+            case 'b':
+                config.block_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                config.concurrency = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                config.duration = strtod(optarg, NULL);
+                config.transfers = 0;
+                break;
+            case 'f':
+                if (config.file_count + size_count == MAX_FILES)
+                {
+                    usage(argv[0]);
+                }
+                snprintf(config.files[config.file_count++].name, sizeof(config.files[0].name), "%s", optarg);
+                break;
+            case 'l':
+                config.loss = strtod(optarg, NULL);
+                break;
+            case 'm':
+                config.mode = optarg;
+                break;
+            case 'n':
+                config.transfers = strtoull(optarg, NULL, 10);
+                config.duration = 0;
+                break;
+            case 'o':
+                config.reorder = strtod(optarg, NULL);
+                break;
+            case 'p':
+                config.root = optarg;
+                break;
+            case 'r':
+                config.retries = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                config.timeout = strtoul(optarg, NULL, 10) / 1e3;
+                break;
+            case 'T':
+                config.server_timeout = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                config.window_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                if (config.file_count + size_count == MAX_FILES)
+                {
+                    usage(argv[0]);
+                }
+                sizes[size_count++] = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || config.concurrency == 0 || (size_count > 0 && config.root == NULL)
+        || config.file_count + size_count == 0)
+    {
+        usage(argv[0]);
+    }
+    config.server.sin_port = htons((uint16_t)strtoul(argv[optind], NULL, 10));
+    config.netascii = !strcasecmp(config.mode, "netascii");
+    // Long enough for the server to resend a block whose last ACK was lost twice
+    config.dally = 2 * (config.server_timeout > 0 ? config.server_timeout : DEFAULT_SERVER_TIMEOUT) + config.timeout;
+
+    for (uint32_t i = 0; i < size_count; i++)
+    {
+        create_file(config.root, &config.files[config.file_count++], sizes[i]);
+    }
+    for (uint32_t i = 0; config.root != NULL && i < config.file_count; i++)
+    {
+        measure_file(config.root, &config.files[i]);
+    }
+
+    // One socket per transfer in flight and those finished ones that
+    // dally, more than the default limit allows
+    struct rlimit limit;
+    if (!ERROR(getrlimit(RLIMIT_NOFILE, &limit)) && limit.rlim_cur < config.concurrency + DALLY_SOCKETS + 16)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    dallying.capacity = 0;
+    if (!ERROR(getrlimit(RLIMIT_NOFILE, &limit)) && limit.rlim_cur > config.concurrency + 16)
+    {
+        uint64_t spare = limit.rlim_cur - config.concurrency - 16;
+        dallying.capacity = spare < DALLY_SOCKETS ? (uint32_t)spare : DALLY_SOCKETS;
+    }
+
+    int32_t epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ERROR(epoll_fd))
+    {
+        exit_error("epoll_create1");
+    }
+    dallying.epoll_fd = epoll_fd;
+    dallying.sockets_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &dallying;
+    if (ERROR(dallying.sockets_fd) || ERROR(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dallying.sockets_fd, &event)))
+    {
+        exit_error("epoll");
+    }
+    bench_client* clients = (bench_client*)malloc(config.concurrency * sizeof(bench_client));
+    if (clients == NULL)
+    {
+        exit_error("malloc");
+    }
+    for (uint32_t i = 0; i < config.concurrency; i++)
+    {
+        clients[i].fd = -1;
+    }
+
+    bench_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint64_t started = 0;
+    uint32_t active = 0;
+    double start = seconds();
+    double end = start + config.duration;
+    double last_check = start;
+    struct epoll_event events[EVENTS];
+    while (true)
+    {
+        // Keep every client busy while there are transfers left to start
+        double now = seconds();
+        bool more = config.transfers > 0 ? started < config.transfers : now < end;
+        active = 0;
+        for (uint32_t i = 0; i < config.concurrency; i++)
+        {
+            if (clients[i].fd < 0 && more)
+            {
+                start_transfer(&config, &clients[i], started++, epoll_fd);
+                more = config.transfers > 0 ? started < config.transfers : now < end;
+            }
+            active += clients[i].fd >= 0;
+        }
+        if (active == 0)
+        {
+            break;
+        }
+
+        int32_t n = epoll_wait(epoll_fd, events, EVENTS, 10);
+        if (ERROR(n) && errno != EINTR)
+        {
+            exit_error("epoll_wait");
+        }
+        now = seconds();
+        for (int32_t i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &dallying)
+            {
+                read_dallying(&stats);
+                continue;
+            }
+            read_packets(&config, &stats, (bench_client*)events[i].data.ptr, now);
+        }
+        if (now - last_check >= 0.01)
+        {
+            check_timeouts(&config, &stats, clients, now);
+            close_dallying(now, false);
+            last_check = now;
+        }
+    }
+    double elapsed = seconds() - start;
+    close_dallying(DBL_MAX, false);
+
+    fprintf(stdout, "%" PRIu64 " transfers in %.2f s, %" PRIu64 " done, %" PRIu64 " errors, %" PRIu64 " gave up, %"
+        PRIu64 " wrong size\n", started, elapsed, stats.done, stats.errors, stats.gave_up, stats.wrong_size);
+    fprintf(stdout, "%.1f transfers/s, %.2f MB/s\n", stats.done / elapsed, stats.bytes / elapsed / 1e6);
+    fprintf(stdout, "%" PRIu64 " packets received, %" PRIu64 " blocks dropped, %" PRIu64 " reordered, %"
+        PRIu64 " ACKs dropped, %" PRIu64 " timeouts, %" PRIu64 " last ACKs resent\n",
+        stats.received, stats.dropped, stats.reordered, stats.acks_dropped, stats.timeouts, stats.last_acks);
+    print_percentiles("transfer", stats.durations, stats.samples);
+    print_percentiles("first block", stats.first_blocks, stats.samples);
+
+    for (uint32_t i = 0; i < config.file_count; i++)
+    {
+        if (config.files[i].created)
+        {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", config.root, config.files[i].name);
+            unlink(path);
+        }
+    }
+    close(dallying.sockets_fd);
+    close(epoll_fd);
+    free(clients);
+    free(stats.durations);
+    free(stats.first_blocks);
+    return stats.errors + stats.gave_up + stats.wrong_size > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}